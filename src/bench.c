@@ -0,0 +1,450 @@
+/*
+ * Benchmark of the plugin without openvpn: bench loads simple.so, opens it
+ * with a generated plugin.conf and plays the calls openvpn makes for each
+ * client (constructor, connect, disconnect, destructor) with synthetic
+ * environments. The time of each connect and disconnect callback is
+ * measured and the throughput and latency percentiles are reported.
+ *
+ *   $ ./build-bench
+ *   $ ./bench -r 16 -c 4000 -n 10 -p churn ./simple.so
+ *
+ * Patterns:
+ *   storm      every round connects all the clients, then disconnects them
+ *   churn      all the clients are connected, then each round disconnects
+ *              and reconnects every client in a random order
+ *   flap       each client connects and disconnects right away
+ *   roam       all the clients are connected, then each round every client
+ *              floats to a new real address (IPCHANGE)
+ *
+ * The plugin arguments after the configuration file (client-config-dir and
+ * options) are given with -o. In async mode each client gets its own
+ * config and deferred files, the time of the callback is measured and the
+ * worker thread is waited for before the client disconnects and before the
+ * total time is taken.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include "openvpn-plugin.h"
+
+#define MAX_PLUGIN_ARGS 16
+// How long the worker thread is waited for, for one client
+#define DEFERRED_TIMEOUT_NS 10000000000ULL
+
+typedef openvpn_plugin_handle_t (*open_v1_t)(unsigned int *, const char *[], const char *[]);
+typedef int (*func_v2_t)(openvpn_plugin_handle_t, const int, const char *[], const char *[], void *, struct openvpn_plugin_string_list **);
+typedef void *(*constructor_t)(openvpn_plugin_handle_t);
+typedef void (*destructor_t)(openvpn_plugin_handle_t, void *);
+typedef void (*close_v1_t)(openvpn_plugin_handle_t);
+
+typedef struct plugin{
+    void *dl;
+    open_v1_t open;
+    func_v2_t func;
+    constructor_t constructor;
+    destructor_t destructor;
+    close_v1_t close;
+    openvpn_plugin_handle_t handle;
+    int connect_type;
+}plugin;
+
+/*
+ * A simulated client: its environment and its per client context
+ */
+typedef struct client{
+    char common_name[64];
+    char trusted_ip[32];
+    // Files given by openvpn to a deferred client connect
+    char config_file[96];
+    char deferred_file[96];
+    const char *envp[8];
+    void *context;
+    // The connect was deferred and its result not read yet
+    int pending;
+}client;
+
+/*
+ * Latency samples of one kind of call, in nanoseconds
+ */
+typedef struct samples{
+    uint64_t *ns;
+    size_t count;
+    size_t size;
+    uint64_t total;
+    int failed;
+}samples;
+
+static uint64_t
+now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+samples_add(samples *s, uint64_t ns){
+    if(s->count == s->size){
+        s->size = s->size ? s->size * 2 : 4096;
+        s->ns = realloc(s->ns, s->size * sizeof(uint64_t));
+        if(s->ns == NULL){
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    s->ns[s->count++] = ns;
+    s->total += ns;
+}
+
+static int
+cmp_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double
+percentile(const samples *s, double p){
+    size_t rank;
+    if(s->count == 0)
+        return 0;
+    rank = (size_t) (p * s->count);
+    if(rank >= s->count)
+        rank = s->count - 1;
+    return s->ns[rank] / 1000.0;
+}
+
+static void
+report(const char *name, samples *s){
+    qsort(s->ns, s->count, sizeof(uint64_t), cmp_u64);
+    printf("%-10s %9zu ops %12.0f ops/s   p50 %8.2fus  p99 %8.2fus  p999 %8.2fus  max %9.2fus  failed %d\n",
+           name, s->count, s->total ? s->count * 1e9 / s->total : 0.0,
+           percentile(s, 0.5), percentile(s, 0.99), percentile(s, 0.999),
+           s->count ? s->ns[s->count - 1] / 1000.0 : 0.0, s->failed);
+}
+
+static int
+load_plugin(plugin *p, const char *path){
+    p->dl = dlopen(path, RTLD_NOW);
+    if(p->dl == NULL){
+        fprintf(stderr, "%s\n", dlerror());
+        return -1;
+    }
+    p->open = (open_v1_t) dlsym(p->dl, "openvpn_plugin_open_v1");
+    p->func = (func_v2_t) dlsym(p->dl, "openvpn_plugin_func_v2");
+    p->constructor = (constructor_t) dlsym(p->dl, "openvpn_plugin_client_constructor_v1");
+    p->destructor = (destructor_t) dlsym(p->dl, "openvpn_plugin_client_destructor_v1");
+    p->close = (close_v1_t) dlsym(p->dl, "openvpn_plugin_close_v1");
+    if(p->open == NULL || p->func == NULL || p->constructor == NULL || p->destructor == NULL || p->close == NULL){
+        fprintf(stderr, "%s is not an openvpn v2 plugin\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * One /24 realm per realm number: 10.x.y.0 for the common names R<n>-*,
+ * the 65536 /24 of 10.0.0.0/8 at most
+ */
+static int
+write_conf(const char *filename, int realms){
+    FILE *fh = fopen(filename, "w");
+    int i;
+    if(fh == NULL)
+        return -1;
+    for(i = 0; i < realms; i++)
+        fprintf(fh, "10.%d.%d.0#^R%d-#255.255.255.0#\n", i / 256, i % 256, i);
+    return fclose(fh);
+}
+
+static void
+client_init(client *c, const char *dir, int id, int realm, int n){
+    snprintf(c->common_name, sizeof(c->common_name), "common_name=R%d-client%d", realm, n);
+    snprintf(c->config_file, sizeof(c->config_file), "client_connect_config_file=%s/config.%d", dir, id);
+    snprintf(c->deferred_file, sizeof(c->deferred_file), "client_connect_deferred_file=%s/deferred.%d", dir, id);
+    c->envp[0] = c->common_name;
+    c->envp[1] = "untrusted_ip=192.0.2.1";
+    c->envp[2] = "untrusted_port=1194";
+    c->envp[3] = c->config_file;
+    c->envp[4] = c->deferred_file;
+    snprintf(c->trusted_ip, sizeof(c->trusted_ip), "trusted_ip=192.0.2.1");
+    c->envp[5] = c->trusted_ip;
+    c->envp[6] = "trusted_port=1194";
+    c->envp[7] = NULL;
+    c->context = NULL;
+    c->pending = 0;
+}
+
+static void
+free_return_list(struct openvpn_plugin_string_list *list){
+    while(list != NULL){
+        struct openvpn_plugin_string_list *next = list->next;
+        free(list->name);
+        free(list->value);
+        free(list);
+        list = next;
+    }
+}
+
+static void
+do_connect(plugin *p, client *c, samples *s){
+    const char *argv[] = { "bench", NULL };
+    struct openvpn_plugin_string_list *return_list = NULL;
+    uint64_t start;
+    int ret;
+
+    c->context = p->constructor(p->handle);
+    start = now_ns();
+    ret = p->func(p->handle, p->connect_type, argv, c->envp, c->context, &return_list);
+    samples_add(s, now_ns() - start);
+    if(ret == OPENVPN_PLUGIN_FUNC_ERROR)
+        s->failed++;
+    c->pending = ret == OPENVPN_PLUGIN_FUNC_DEFERRED;
+    free_return_list(return_list);
+}
+
+/*
+ * Wait for the worker thread to write the result of a deferred connect,
+ * a failure counts as a failed connect
+ */
+static void
+wait_deferred(client *c, samples *s){
+    const char *file = strchr(c->deferred_file, '=') + 1;
+    struct timespec pause = { 0, 10000 };
+    uint64_t start = now_ns();
+    char status = '\0';
+
+    if(!c->pending)
+        return;
+    while(now_ns() - start < DEFERRED_TIMEOUT_NS){
+        int fd = open(file, O_RDONLY);
+        if(fd >= 0){
+            int n = read(fd, &status, 1);
+            close(fd);
+            if(n == 1)
+                break;
+        }
+        nanosleep(&pause, NULL);
+    }
+    if(status != '1')
+        s->failed++;
+    unlink(file);
+    c->pending = 0;
+}
+
+static void
+drain(client *c, int clients, samples *s){
+    int i;
+    for(i = 0; i < clients; i++)
+        wait_deferred(&c[i], s);
+}
+
+static void
+do_disconnect(plugin *p, client *c, samples *s){
+    const char *argv[] = { "bench", NULL };
+    uint64_t start = now_ns();
+    if(p->func(p->handle, OPENVPN_PLUGIN_CLIENT_DISCONNECT, argv, c->envp, c->context, NULL) != OPENVPN_PLUGIN_FUNC_SUCCESS)
+        s->failed++;
+    samples_add(s, now_ns() - start);
+    p->destructor(p->handle, c->context);
+    c->context = NULL;
+}
+
+/*
+ * The client shows up from another real address
+ */
+static void
+do_float(plugin *p, client *c, int round, samples *s){
+    const char *argv[] = { "bench", NULL };
+    uint64_t start;
+    snprintf(c->trusted_ip, sizeof(c->trusted_ip), "trusted_ip=198.51.100.%d", round % 250 + 1);
+    start = now_ns();
+    if(p->func(p->handle, OPENVPN_PLUGIN_IPCHANGE, argv, c->envp, c->context, NULL) != OPENVPN_PLUGIN_FUNC_SUCCESS)
+        s->failed++;
+    samples_add(s, now_ns() - start);
+}
+
+static void
+shuffle(int *order, int n){
+    int i;
+    for(i = n - 1; i > 0; i--){
+        int j = rand() % (i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+}
+
+static void
+usage(const char *name){
+    fprintf(stderr, "usage: %s [-r realms] [-c clients] [-n rounds] [-p storm|churn|flap|roam] [-s seed] [-o plugin_arg]... simple.so\n", name);
+    exit(2);
+}
+
+int
+main(int argc, char *argv[]){
+    const char *plugin_args[MAX_PLUGIN_ARGS];
+    const char *penv[] = { NULL };
+    int nargs = 0, realms = 4, clients = 1000, rounds = 10, opt, i, r;
+    const char *pattern = "storm";
+    char dir[] = "/tmp/realm-bench-XXXXXX";
+    char conf[PATH_MAX], leases[PATH_MAX];
+    unsigned int type_mask = 0;
+    samples connects = { 0 }, disconnects = { 0 }, floats = { 0 };
+    client *c;
+    int *order;
+    plugin p;
+    uint64_t start, open_ns, close_ns;
+
+    srand(1);
+    while((opt = getopt(argc, argv, "r:c:n:p:s:o:")) != -1){
+        switch(opt){
+        case 'r':
+            realms = atoi(optarg);
+            break;
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 'p':
+            pattern = optarg;
+            break;
+        case 's':
+            srand(atoi(optarg));
+            break;
+        case 'o':
+            if(nargs == MAX_PLUGIN_ARGS - 3)
+                usage(argv[0]);
+            plugin_args[2 + nargs++] = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    // write_conf has 65536 networks
+    if(optind != argc - 1 || realms <= 0 || realms > 65536 || clients <= 0 || rounds <= 0)
+        usage(argv[0]);
+    if(strcmp(pattern, "storm") && strcmp(pattern, "churn") && strcmp(pattern, "flap") && strcmp(pattern, "roam"))
+        usage(argv[0]);
+
+    memset(&p, 0, sizeof(p));
+    if(load_plugin(&p, argv[optind]) != 0)
+        return 1;
+    if(mkdtemp(dir) == NULL){
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(conf, sizeof(conf), "%s/plugin.conf", dir);
+    snprintf(leases, sizeof(leases), "%s/plugin.conf.leases", dir);
+    if(write_conf(conf, realms) != 0){
+        perror(conf);
+        return 1;
+    }
+    plugin_args[0] = argv[optind];
+    plugin_args[1] = conf;
+    plugin_args[2 + nargs] = NULL;
+
+    start = now_ns();
+    p.handle = p.open(&type_mask, plugin_args, penv);
+    open_ns = now_ns() - start;
+    if(p.handle == NULL){
+        fprintf(stderr, "Plugin open failed\n");
+        return 1;
+    }
+    if(type_mask & OPENVPN_PLUGIN_MASK(OPENVPN_PLUGIN_CLIENT_CONNECT_V2))
+        p.connect_type = OPENVPN_PLUGIN_CLIENT_CONNECT_V2;
+    else if(type_mask & OPENVPN_PLUGIN_MASK(OPENVPN_PLUGIN_CLIENT_CONNECT))
+        p.connect_type = OPENVPN_PLUGIN_CLIENT_CONNECT;
+    else
+        p.connect_type = OPENVPN_PLUGIN_TLS_FINAL;
+
+    c = calloc(clients, sizeof(client));
+    order = malloc(clients * sizeof(int));
+    if(c == NULL || order == NULL){
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    // Clients spread evenly over the realms
+    for(i = 0; i < clients; i++){
+        client_init(&c[i], dir, i, i % realms, i / realms);
+        order[i] = i;
+    }
+
+    // In async mode the deferred connects are drained before the clients
+    // leave, as openvpn waits for them
+    start = now_ns();
+    if(!strcmp(pattern, "storm")){
+        for(r = 0; r < rounds; r++){
+            for(i = 0; i < clients; i++)
+                do_connect(&p, &c[i], &connects);
+            drain(c, clients, &connects);
+            for(i = 0; i < clients; i++)
+                do_disconnect(&p, &c[i], &disconnects);
+        }
+    }else if(!strcmp(pattern, "churn")){
+        for(i = 0; i < clients; i++)
+            do_connect(&p, &c[i], &connects);
+        drain(c, clients, &connects);
+        for(r = 0; r < rounds; r++){
+            shuffle(order, clients);
+            for(i = 0; i < clients; i++){
+                do_disconnect(&p, &c[order[i]], &disconnects);
+                do_connect(&p, &c[order[i]], &connects);
+            }
+            drain(c, clients, &connects);
+        }
+        for(i = 0; i < clients; i++)
+            do_disconnect(&p, &c[i], &disconnects);
+    }else if(!strcmp(pattern, "roam")){
+        for(i = 0; i < clients; i++)
+            do_connect(&p, &c[i], &connects);
+        drain(c, clients, &connects);
+        for(r = 0; r < rounds; r++){
+            for(i = 0; i < clients; i++)
+                do_float(&p, &c[i], r, &floats);
+        }
+        for(i = 0; i < clients; i++)
+            do_disconnect(&p, &c[i], &disconnects);
+    }else{
+        for(r = 0; r < rounds; r++){
+            for(i = 0; i < clients; i++){
+                do_connect(&p, &c[i], &connects);
+                wait_deferred(&c[i], &connects);
+                do_disconnect(&p, &c[i], &disconnects);
+            }
+        }
+    }
+    printf("%s: %d realms, %d clients, %d rounds, pattern %s, %s, %.3fs\n", argv[optind], realms, clients, rounds, pattern,
+           p.connect_type == OPENVPN_PLUGIN_CLIENT_CONNECT_V2 ? "CLIENT_CONNECT_V2"
+           : p.connect_type == OPENVPN_PLUGIN_CLIENT_CONNECT ? "CLIENT_CONNECT" : "TLS_FINAL",
+           (now_ns() - start) / 1e9);
+    report("connect", &connects);
+    report("disconnect", &disconnects);
+    if(floats.count > 0)
+        report("ipchange", &floats);
+
+    start = now_ns();
+    p.close(p.handle);
+    close_ns = now_ns() - start;
+    printf("open %.3fs, close %.3fs\n", open_ns / 1e9, close_ns / 1e9);
+    dlclose(p.dl);
+    unlink(leases);
+    unlink(conf);
+    for(i = 0; i < clients; i++)
+        unlink(strchr(c[i].config_file, '=') + 1);
+    rmdir(dir);
+    free(connects.ns);
+    free(disconnects.ns);
+    free(floats.ns);
+    free(order);
+    free(c);
+    return 0;
+}
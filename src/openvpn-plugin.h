@@ -22,7 +22,9 @@
  *                      *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  *                       */
 
-#define OPENVPN_PLUGIN_VERSION 2
+#define OPENVPN_PLUGIN_VERSION 3
+
+#include <stdarg.h>
 
 /*
  *  * Plug-in types.  These types correspond to the set of script callbacks
@@ -163,6 +165,84 @@ struct openvpn_plugin_string_list
   char *value;
 };
 
+/*
+ * Version of the v3 plugin structures, openvpn_plugin_open_v3 is called
+ * with it so the plugin can check it knows them.
+ */
+#define OPENVPN_PLUGINv3_STRUCTVER 1
+
+/*
+ * Log flags for the plugin_log callback
+ */
+typedef enum
+{
+  PLOG_ERR    = (1 << 0),  /* Error condition message */
+  PLOG_WARN   = (1 << 1),  /* General warning message */
+  PLOG_NOTE   = (1 << 2),  /* Informational message */
+  PLOG_DEBUG  = (1 << 3),  /* Debug message, displayed if verb >= 7 */
+
+  PLOG_ERRNO  = (1 << 8),  /* Add error description to message */
+  PLOG_NOMUTE = (1 << 9),  /* Mute setting does not apply for message */
+} openvpn_plugin_log_flags_t;
+
+typedef void (*plugin_log_t) (openvpn_plugin_log_flags_t flags,
+                              const char *plugin_name,
+                              const char *format, ...);
+
+typedef void (*plugin_vlog_t) (openvpn_plugin_log_flags_t flags,
+                               const char *plugin_name,
+                               const char *format,
+                               va_list arglist);
+
+/*
+ * Callbacks OpenVPN gives to the plugin in openvpn_plugin_open_v3.
+ * They must only be called from the thread OpenVPN called the plugin on.
+ */
+struct openvpn_plugin_callbacks
+{
+  plugin_log_t    plugin_log;
+  plugin_vlog_t   plugin_vlog;
+};
+
+typedef enum {
+  SSLAPI_NONE,
+  SSLAPI_OPENSSL,
+  SSLAPI_POLARSSL
+} ovpnSSLAPI;
+
+/*
+ * Arguments given to openvpn_plugin_open_v3
+ *
+ * type_mask : the logical OR of all plug-in types this OpenVPN supports
+ * argv      : same as in openvpn_plugin_open_v2
+ * envp      : same as in openvpn_plugin_open_v2
+ * callbacks : functions the plugin can call back into OpenVPN
+ * ssl_api   : the SSL library OpenVPN is using
+ */
+struct openvpn_plugin_args_open_in
+{
+  const int type_mask;
+  const char ** const argv;
+  const char ** const envp;
+  struct openvpn_plugin_callbacks *callbacks;
+  const ovpnSSLAPI ssl_api;
+};
+
+/*
+ * Values returned by openvpn_plugin_open_v3
+ *
+ * type_mask   : the plug-in types the plug-in wants to intercept
+ * handle      : where the plugin stores its context, handed back to
+ *               every other function
+ * return_list : used to return data back to OpenVPN
+ */
+struct openvpn_plugin_args_open_return
+{
+  int  type_mask;
+  openvpn_plugin_handle_t *handle;
+  struct openvpn_plugin_string_list **return_list;
+};
+
 /*
  *  * Multiple plugin modules can be cascaded, and modules can be
  *   * used in tandem with scripts.  The order of operation is that
@@ -231,6 +311,29 @@ OPENVPN_PLUGIN_DEF openvpn_plugin_handle_t OPENVPN_PLUGIN_FUNC(openvpn_plugin_op
       const char *envp[],
       struct openvpn_plugin_string_list **return_list);
 
+/*
+ * FUNCTION: openvpn_plugin_open_v3
+ *
+ * REQUIRED: NO
+ *
+ * Called on initial plug-in load instead of openvpn_plugin_open_v2 when
+ * the plug-in defines it.
+ *
+ * ARGUMENTS
+ *
+ * version   : OPENVPN_PLUGINv3_STRUCTVER of OpenVPN
+ * arguments : see struct openvpn_plugin_args_open_in
+ * retptr    : see struct openvpn_plugin_args_open_return
+ *
+ * RETURN VALUE
+ *
+ * OPENVPN_PLUGIN_FUNC_SUCCESS on success, OPENVPN_PLUGIN_FUNC_ERROR on failure
+ */
+OPENVPN_PLUGIN_DEF int OPENVPN_PLUGIN_FUNC(openvpn_plugin_open_v3)
+     (const int version,
+      struct openvpn_plugin_args_open_in const *arguments,
+      struct openvpn_plugin_args_open_return *retptr);
+
 /*
  *  * FUNCTION: openvpn_plugin_func_v2
  *   *
@@ -33,78 +33,591 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <sys/epoll.h>
+#include <sched.h>
 #include "openvpn-plugin.h"
 
-#define INDEX_NETWORK 0
-#define INDEX_REGEX 1
-#define INDEX_NETMASK 2
-// TODO : It should be 3 but I have a bug that I need to correct
-#define NUM_PARAM_CONF 4
+// Room for a dotted quad
+#define ADDRESS_TEXT_SIZE 16
+// Longest common name handled, with its terminating zero
+#define COMMON_NAME_SIZE 72
+// Room for an IPv6 address
+#define REMOTE_TEXT_SIZE 46
 
 /*
- * Each subnet_ip correspond to an ip address
+ * Free address bitmap of a realm: one bit per address (1 = used), and a
+ * summary word on top where each bit tells that a whole bitmap word is full.
+ * Finding a free address is a find-first-zero over the summary then over
+ * the word, releasing one is a single bit clear. hint is the first summary
+ * word that may not be full. The bitmaps are zeroed pages that are only
+ * backed by memory once written, a /8 costs nothing until it is used.
+ *
+ * With shm=NAME the bitmaps of a realm live in the POSIX shared memory
+ * segment NAME-network-prefix instead, so every openvpn instance of the
+ * host draws from the same pool. The bits are then taken and given back
+ * with atomic operations, without any lock between the instances, and each
+ * address has an owner byte: the shm-id of the instance that holds it. An
+ * instance only gives back the addresses it owns, and takes back on start
+ * the ones left under its id by its previous run. Exclusions are refused
+ * with a shared pool, one instance would give back what another excluded.
  */
-typedef struct subnet_ip{
-    char *address;
-    int used;
-    char *common_name;
-}subnet_ip;
- 
+#define POOL_SEGMENT_MAGIC 0x504f4f4c
+#define POOL_SEGMENT_VERSION 1
+#define POOL_MAX_ID 254
+
+typedef struct pool_segment{
+    uint32_t magic;
+    uint32_t version;
+    int32_t size;
+    int32_t nfree;
+    // The bitmap starts on its own cache line
+    uint8_t reserved[48];
+}pool_segment;
+
+typedef struct ip_pool{
+    uint64_t *bits;
+    uint64_t *summary;
+    int size;
+    int nwords;
+    int nsummary;
+    int nfree;
+    int hint;
+    // Addresses taken by this instance, the exclusions aside
+    int nused;
+    // Shared pool, NULL when the bitmaps are private
+    pool_segment *shared;
+    uint8_t *owner;
+    size_t map_size;
+    int id;
+}ip_pool;
+
+/*
+ * Inclusive range of addresses, or of pool indexes once the pool is built
+ */
+typedef struct addr_range{
+    uint32_t first;
+    uint32_t last;
+}addr_range;
+
+/*
+ * Index by common name: open addressing with linear probing over records
+ * that keep their common name at name_offset. The hash is kept in the slot
+ * so that a probe only reads the record when the hashes are the same.
+ */
+#define CN_INDEX_MIN_CAPACITY 64
+
+typedef struct cn_slot{
+    uint32_t hash;
+    void *item;
+}cn_slot;
+
+typedef struct cn_index{
+    cn_slot *slots;
+    uint32_t capacity;
+    uint32_t count;
+    size_t name_offset;
+    // Bumped by every insert and delete, for the admin snapshots
+    uint32_t changes;
+}cn_index;
+
+/*
+ * Virtual address routed by openvpn to a client (OPENVPN_PLUGIN_LEARN_ADDRESS),
+ * linked in the list of its client. realm is set when the address was free
+ * in a realm pool and had to be taken out of it while it is routed.
+ */
+typedef struct learned_addr{
+    struct learned_addr *next;
+    struct learned_addr **pprev;
+    struct plugin_per_client_context *client;
+    struct realm_conf *realm;
+    int index;
+    uint32_t address;
+}learned_addr;
 
 /*
- * Client context information
+ * Learned addresses by address, same layout as cn_index
+ */
+typedef struct addr_slot{
+    uint32_t address;
+    learned_addr *item;
+}addr_slot;
+
+typedef struct addr_index{
+    addr_slot *slots;
+    uint32_t capacity;
+    uint32_t count;
+    // Entries ready to be reused
+    learned_addr *spare;
+}addr_index;
+
+/*
+ * Arena: the long lived data of a realm (the realm itself, its addresses
+ * and its pool) or of the matcher is carved out of a few chunks, and freed
+ * all at once with the arena. Memory given by the arena is zeroed.
+ */
+#define ARENA_CHUNK 1024
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk{
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+}arena_chunk;
+
+typedef struct arena{
+    arena_chunk *chunks;
+}arena;
+
+struct realm_conf;
+
+/*
+ * Client context information: the realm is NULL until the client has an
+ * address, which is first_addr + index in the realm
  */
 typedef struct plugin_per_client_context {
-  subnet_ip *ip;
-  char* generated_conf_file;
+  struct realm_conf *realm;
+  int index;
+  char common_name[COMMON_NAME_SIZE];
+  uint32_t hash;
+  // Addresses openvpn routes to the client
+  struct learned_addr *learned;
+  // Real address of the client, updated on IPCHANGE
+  char remote[REMOTE_TEXT_SIZE];
+  int remote_port;
+  // Deferred connection not handled yet by the worker
+  struct connect_job *job;
+  // A client-config-dir file was written for the client
+  int conf_written;
 }plugin_per_client_context;
 
 /*
- * Each subnet config
+ * Address reserved from the lease file for a client that was connected
+ * before the restart
+ */
+typedef struct realm_orphan{
+    int index;
+    const char *common_name;
+}realm_orphan;
+
+/*
+ * How a realm picks the address of a new client: the first free one, or
+ * one derived from the hash of its common name
+ */
+#define REALM_POLICY_FIRST 0
+#define REALM_POLICY_HASH 1
+
+/*
+ * Configuration of a client, compiled from the ifconfig-push line and the
+ * push lines of its realm: literal pieces, the netmask already in them,
+ * with the address of the client between two pieces. Rendering is a copy
+ * of each piece. One allocation, the text follows the lengths.
+ */
+#define PUSH_CONF_SIZE 4096
+
+typedef struct push_template{
+    int npieces;
+    const char *text;
+    size_t len[];
+}push_template;
+
+/*
+ * Each subnet config. The addresses handed out go from first_addr (the
+ * network address and the gateway are skipped) to the broadcast address
+ * minus 2, address i of the pool is first_addr + i.
  */
 typedef struct realm_conf{
+    // Holds the realm itself
+    arena arena;
     const char *network;
     const char *netmask;
+    // On the heap, it moves to the realm carried over by a reload
     const char *regex;
-    int start[4];
-    int end[4];
-    subnet_ip **subnet;
+    int prefix;
+    uint32_t network_addr;
+    uint32_t first_addr;
+    int policy;
+    ip_pool pool;
+    // One bit per address still reserved for an orphan
+    uint64_t *reserved;
+    // push lines as read, then compiled in conf. On the heap as it moves
+    // with a reload.
+    char *push;
+    size_t push_len;
+    push_template *conf;
+    // Labels of the realm metrics, escaped once. On the heap as it moves
+    // with a reload.
+    char *labels;
+    // Packet filter file of the clients, rendered at load, NULL without a
+    // pf section. On the heap as it moves with a reload.
+    char *pf;
+    size_t pf_len;
+    int pf_section;
+    int pf_seen;
+    // Excluded ranges, sorted, on the heap as they move with a reload
+    addr_range *exclude;
+    int nexclude;
+    // One bit per address kept out of the pool by the exclusions
+    uint64_t *excluded;
+    int nexcluded;
+    // Addresses reserved from the lease file, taken back when the pool is full
+    realm_orphan *orphans;
+    int norphans;
+    int orphans_size;
+    // Removed from the configuration, kept until its last client leaves
+    int retired;
+    struct realm_conf *retired_next;
+    // Metrics, updated under the context lock
+    uint64_t connects;
+    uint64_t disconnects;
+    uint64_t alloc_failures;
+    uint64_t reconnects;
+    uint64_t conflicts;
+    uint64_t floats;
+    // Addresses held for clients in their grace period
+    int nheld;
+    // Addresses still reserved for orphans
+    int nreserved;
  }realm_conf;
+
+/*
+ * Reconnect grace period: the address of a client that leaves is held for
+ * grace seconds, and given back to the same common name if it comes back
+ * in the meantime. Holds are found by common name in a cn_index and expire through a hierarchical timing wheel of HOLD_LEVELS
+ * levels of HOLD_SLOTS slots, level n ticking every HOLD_SLOTS^n seconds:
+ * a hold is linked in the slot of its expiry, moved down a level at most
+ * HOLD_LEVELS - 1 times and released when level 0 reaches it, so expiring
+ * costs O(1) per hold whatever the number of holds.
+ */
+#define HOLD_SLOT_BITS 6
+#define HOLD_SLOTS (1 << HOLD_SLOT_BITS)
+#define HOLD_LEVELS 4
+// The wheel covers HOLD_SLOTS^HOLD_LEVELS seconds, about 194 days
+#define GRACE_MAX (30 * 86400)
+
+typedef struct lease_hold{
+    struct lease_hold *next;
+    struct lease_hold **pprev;
+    struct realm_conf *realm;
+    int index;
+    uint32_t hash;
+    uint64_t expires;
+    char common_name[COMMON_NAME_SIZE];
+}lease_hold;
+
+typedef struct hold_wheel{
+    // Last second processed
+    uint64_t now;
+    lease_hold *slots[HOLD_LEVELS][HOLD_SLOTS];
+    cn_index index;
+    // Holds ready to be reused
+    lease_hold *spare;
+}hold_wheel;
+
+/*
+ * Connect latency in nanoseconds, HDR style: a value falls in the bucket of
+ * its top LATENCY_SUB_BITS + 1 bits, so each power of two is split in
+ * LATENCY_SUB buckets and the error stays under 1/LATENCY_SUB. Values
+ * above 2^36 ns (about a minute) go in the last bucket. Recording is one
+ * relaxed atomic add per counter, from any thread.
+ */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_SHIFT 31
+#define LATENCY_BUCKETS ((LATENCY_MAX_SHIFT + 2) * LATENCY_SUB)
+
+typedef struct latency_histogram{
+    uint64_t sum;
+    uint64_t buckets[LATENCY_BUCKETS];
+}latency_histogram;
  
  /*
   * The full plugin context, with the different configuration
   */
  typedef struct plugin_context{
   char *conf_dir;
+  // conf_dir opened once, the client files are written relative to it
+  int conf_dirfd;
   char *plugin_conf;
   int numRealm;
   realm_conf **configs;
+  // The realms sorted by network, to find the realm of an address
+  realm_conf **by_network;
+  struct realm_matcher *matcher;
+  struct lease_store *leases;
+  // Hot reload of plugin_conf
+  pthread_t reload_thread;
+  pthread_mutex_t reload_lock;
+  pthread_cond_t reload_cond;
+  int reload_running;
+  int reload_stop;
+  int reload_busy;
+  struct stat conf_stat;
+  struct realm_reload *reload_next;
+  struct realm_reload *garbage;
+  realm_conf *retired;
+  // Clients holding an address, by common name
+  cn_index clients;
+  // Addresses routed by openvpn
+  addr_index learned;
+  // Reconnect grace period in seconds, 0 releases the address at once
+  int grace;
+  // Refuse at TLS_VERIFY the clients that cannot get an address
+  int tls_verify;
+  // A realm had a pf section at plugin open, OPENVPN_PLUGIN_ENABLE_PF is used
+  int pf;
+  // Pools shared by the instances of the host, and the id of this one
+  char *shm;
+  int shm_id;
+  hold_wheel holds;
+  // Held while realms, pools and leases are used, the worker thread of
+  // the async mode allocates addresses
+  pthread_mutex_t lock;
+  // Deferred client connect
+  int async;
+  pthread_t queue_thread;
+  pthread_mutex_t queue_lock;
+  pthread_cond_t queue_cond;
+  int queue_running;
+  int queue_stop;
+  struct connect_job *queue_head;
+  struct connect_job *queue_tail;
+  // Jobs done by the worker, reused by the next connections
+  struct connect_job *queue_spare;
+  // Metrics export
+  latency_histogram latency;
+  uint64_t unmatched;
+  char *stats_file;
+  char *stats_socket;
+  int stats_interval;
+  int stats_fd;
+  int stats_pipe[2];
+  pthread_t stats_thread;
+  int stats_running;
+  // Configurations applied, for the admin snapshots
+  uint32_t reloads;
+  // Admin socket
+  char *admin_socket;
+  int admin_fd;
+  int admin_pipe[2];
+  pthread_t admin_thread;
+  int admin_running;
 }plugin_context;
 
-//Todo: move it in a header
-static int get_nb_line(char *file_name);
-static int get_config(struct plugin_context *context, const char *argv[], const char *envp[]);
-static int generate_subnet(struct plugin_context *context, const char *argv[], const char *envp[]);
+/*
+ * Logging: messages are formatted in a lock-free ring buffer and written
+ * in batches, through the plugin_log callback of openvpn when the plugin
+ * was opened with openvpn_plugin_open_v3, on stdout otherwise. Messages
+ * above REALM_LOG_COMPILE_LEVEL are not compiled in and messages above
+ * the verb option are dropped before being formatted. Everything logged
+ * on the connect path is at debug level.
+ */
+#define REALM_LOG_ERROR 0
+#define REALM_LOG_WARN 1
+#define REALM_LOG_INFO 2
+#define REALM_LOG_DEBUG 3
+
+#ifndef REALM_LOG_COMPILE_LEVEL
+#define REALM_LOG_COMPILE_LEVEL REALM_LOG_DEBUG
+#endif
+#define REALM_LOG_DEFAULT_LEVEL REALM_LOG_INFO
+
+#define LOG_PREFIX "PLUGIN_REALM"
+#define LOG_RING_SIZE 1024
+#define LOG_LINE_SIZE 248
+#define LOG_FLUSH_BATCH 64
 
+typedef struct log_entry{
+    unsigned int seq;
+    int level;
+    char line[LOG_LINE_SIZE];
+}log_entry;
 
+static struct realm_logger{
+    int level;
+    plugin_log_t plugin_log;
+    unsigned int head;      // next entry to fill
+    unsigned int tail;      // next entry to write
+    int flushing;
+    int urgent;             // a warning or an error is waiting
+    unsigned int dropped;
+    time_t last_flush;
+    log_entry ring[LOG_RING_SIZE];
+}logger = { .level = REALM_LOG_DEFAULT_LEVEL };
 
+#define realm_log(lvl, ...) \
+    do{ \
+        if((lvl) <= REALM_LOG_COMPILE_LEVEL && (lvl) <= logger.level) \
+            log_write((lvl), __VA_ARGS__); \
+    }while(0)
+
+static void
+log_init(int level, plugin_log_t plugin_log){
+    unsigned int i;
+    logger.level = level;
+    logger.plugin_log = plugin_log;
+    logger.head = logger.tail = 0;
+    for(i = 0; i < LOG_RING_SIZE; i++)
+        logger.ring[i].seq = i;
+}
 
 /*
- * Free Context: This function will free the context for the plugin 
+ * Queue a message, any thread can call it. The message is dropped when the
+ * ring is full.
  */
-static int free_plugin_context(plugin_context * context){
-    int i;
-    for(i = 0; context->configs[i] ; i++){
-        for(i = 0; context->configs[i]->subnet[i] ; i++){
-            free(context->configs[i]->subnet[i]);
+static void __attribute__((format(printf, 2, 3)))
+log_write(int level, const char *format, ...){
+    unsigned int pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+    log_entry *entry;
+    va_list ap;
+
+    for(;;){
+        int diff;
+        entry = &logger.ring[pos & (LOG_RING_SIZE - 1)];
+        diff = (int)(__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) - pos);
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&logger.head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }else if(diff < 0){
+            __atomic_fetch_add(&logger.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }else{
+            pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
         }
-        free(context->configs[i]->subnet);
-        free(context->configs[i]);
     }
-    free(context->configs);
-    return 0;
+    entry->level = level;
+    va_start(ap, format);
+    vsnprintf(entry->line, LOG_LINE_SIZE, format, ap);
+    va_end(ap);
+    __atomic_store_n(&entry->seq, pos + 1, __ATOMIC_RELEASE);
+    if(level <= REALM_LOG_WARN)
+        __atomic_store_n(&logger.urgent, 1, __ATOMIC_RELAXED);
+}
+
+static openvpn_plugin_log_flags_t
+log_flags(int level){
+    switch(level){
+    case REALM_LOG_ERROR:
+        return PLOG_ERR;
+    case REALM_LOG_WARN:
+        return PLOG_WARN;
+    case REALM_LOG_INFO:
+        return PLOG_NOTE;
+    default:
+        return PLOG_DEBUG;
+    }
 }
 
+/*
+ * Write the whole buffer on stdout. A failure has nowhere to be reported,
+ * the lines are dropped.
+ */
+static void
+log_write_stdout(const char *buf, size_t len){
+    while(len > 0){
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Write the queued messages. With plugin_log this must be the openvpn
+ * thread, otherwise the lines are gathered and written with one syscall.
+ */
+static void
+log_flush(void){
+    char buf[LOG_FLUSH_BATCH * (LOG_LINE_SIZE + sizeof(LOG_PREFIX) + 3)];
+    size_t len = 0;
+    unsigned int dropped;
+    struct timespec now;
+
+    if(__atomic_exchange_n(&logger.flushing, 1, __ATOMIC_ACQUIRE))
+        return;
+    __atomic_store_n(&logger.urgent, 0, __ATOMIC_RELAXED);
+    for(;;){
+        unsigned int pos = __atomic_load_n(&logger.tail, __ATOMIC_RELAXED);
+        log_entry *entry = &logger.ring[pos & (LOG_RING_SIZE - 1)];
+        int ready = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) == pos + 1;
+
+        if(len > 0 && (!ready || sizeof(buf) - len < LOG_LINE_SIZE + sizeof(LOG_PREFIX) + 3)){
+            log_write_stdout(buf, len);
+            len = 0;
+        }
+        if(!ready)
+            break;
+        if(logger.plugin_log != NULL){
+            logger.plugin_log(log_flags(entry->level), LOG_PREFIX, "%s", entry->line);
+        }else{
+            size_t n = strlen(entry->line);
+            memcpy(buf + len, LOG_PREFIX ": ", sizeof(LOG_PREFIX) + 1);
+            len += sizeof(LOG_PREFIX) + 1;
+            memcpy(buf + len, entry->line, n);
+            len += n;
+            buf[len++] = '\n';
+        }
+        __atomic_store_n(&entry->seq, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&logger.tail, pos + 1, __ATOMIC_RELAXED);
+    }
+    dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED);
+    if(dropped > 0)
+        log_write(REALM_LOG_WARN, "%u log messages dropped", dropped);
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    logger.last_flush = now.tv_sec;
+    __atomic_store_n(&logger.flushing, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Called by the openvpn thread after each callback: write the messages
+ * when a batch is ready, a warning is waiting or the oldest is a second old
+ */
+static void
+log_maybe_flush(void){
+    unsigned int queued = __atomic_load_n(&logger.head, __ATOMIC_RELAXED) - __atomic_load_n(&logger.tail, __ATOMIC_RELAXED);
+    struct timespec now;
+
+    if(queued == 0)
+        return;
+    if(queued < LOG_FLUSH_BATCH && !__atomic_load_n(&logger.urgent, __ATOMIC_RELAXED)){
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        if(now.tv_sec == logger.last_flush)
+            return;
+    }
+    log_flush();
+}
+
+//Todo: move it in a header
+static int get_config(struct plugin_context *context, const char *argv[], const char *envp[]);
+static int generate_subnet(struct plugin_context *context, const char *argv[], const char *envp[]);
+static void matcher_free(struct realm_matcher *m);
+static void lease_close(struct lease_store *store);
+static void release_retired(struct plugin_context *context, realm_conf *realm);
+static void client_release(struct plugin_context *context, struct plugin_per_client_context *client_conf);
+static void conf_dir_remove(struct plugin_context *context, const char *common_name);
+static int conf_parse_ipv4(const char *s, uint32_t *addr);
+static void free_realm(realm_conf *realm);
+static int client_disconnect(struct plugin_context *context, const char *argv[], const char *envp[], struct plugin_per_client_context *client_conf);
+
+
+
+
 /*
  *  Given an environmental variable name, search
  *  the envp array for its value, returning it
@@ -130,334 +643,4806 @@ get_env (const char *name, const char *envp[])
   return NULL;
 }
 
-
 /*
- * Found an ip address available in the array of teh subnet
+ * Look up several variables in a single pass over envp: values[i] is set
+ * to the value of names[i], or NULL when it is missing
  */
-struct subnet_ip *
-found_ip_realm(const char *name, struct realm_conf *conf){
-    int i=0;
-    printf("PLUGIN_REALM: found_ip_realm %s netmask\n", conf->network);
-    for (i =0 ; conf->subnet[i] ;i++){
-        if(conf->subnet[i]->used == 0){
-            conf->subnet[i]->used = 1;
-            conf->subnet[i]->common_name = strdup(name);
-            return conf->subnet[i];
+static void
+get_env_list (const char *const names[], const char *values[], int n, const char *envp[])
+{
+    int i, j, left = n;
+    for(j = 0; j < n; j++)
+        values[j] = NULL;
+    for(i = 0; envp != NULL && envp[i] != NULL && left > 0; i++){
+        const char *eq = strchr(envp[i], '=');
+        if(eq == NULL)
+            continue;
+        for(j = 0; j < n; j++){
+            if(values[j] == NULL && !strncmp(envp[i], names[j], eq - envp[i]) && names[j][eq - envp[i]] == '\0'){
+                values[j] = eq + 1;
+                left--;
+                break;
+            }
         }
     }
-    return NULL;
 }
 
+static void *
+arena_alloc(arena *a, size_t size){
+    arena_chunk *chunk = a->chunks;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if(chunk == NULL || chunk->size - chunk->used < size){
+        size_t chunk_size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        chunk = calloc(1, offsetof(arena_chunk, data) + chunk_size);
+        if(chunk == NULL)
+            return NULL;
+        chunk->size = chunk_size;
+        if(a->chunks != NULL && size > ARENA_CHUNK){
+            // A big block gets a chunk of its own, the current one is still filled
+            chunk->used = size;
+            chunk->next = a->chunks->next;
+            a->chunks->next = chunk;
+            return chunk->data;
+        }
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+    }
+    p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
 
+static char *
+arena_strdup(arena *a, const char *s){
+    size_t len = strlen(s) + 1;
+    char *p = arena_alloc(a, len);
+    if(p != NULL)
+        memcpy(p, s, len);
+    return p;
+}
 
-/* 
- * matchhere: search for regexp at beginning of text 
- */
-int matchhere(char *regexp, char *text)
-{
-	if (regexp[0] == '\0')
-		return 1;
-	if (regexp[1] == '*')
-		return matchstar(regexp[0], regexp+2, text);
-	if (regexp[0] == '$' && regexp[1] == '\0')
-		return *text == '\0';
-	if (*text!='\0' && (regexp[0]=='.' || regexp[0]==*text))
-		return matchhere(regexp+1, text+1);
-	return 0;
+static void
+arena_free(arena *a){
+    arena_chunk *chunk = a->chunks;
+    while(chunk != NULL){
+        arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    a->chunks = NULL;
+}
+
+static realm_conf *
+new_realm(void){
+    arena a = { NULL };
+    realm_conf *realm = arena_alloc(&a, sizeof(realm_conf));
+    if(realm != NULL)
+        realm->arena = a;
+    return realm;
 }
 
 /*
- * match: search for regexp anywhere in text 
+ * Mark the padding bits of the last word as used so they are never handed
+ * out, and the summary bits that do not correspond to a word as full
  */
-int match(char *regexp, char *text)
-{
-	if (regexp[0] == '^')
-		return matchhere(regexp+1, text);
-	do {	/* must look even if string is empty */
-		if (matchhere(regexp, text))
-			return 1;
-	} while (*text++ != '\0');
-	return 0;
+static void
+pool_pad(ip_pool *pool){
+    if(pool->size % 64)
+        pool->bits[pool->nwords - 1] |= ~0ULL << (pool->size % 64);
+    if(pool->nwords % 64)
+        pool->summary[pool->nsummary - 1] |= ~0ULL << (pool->nwords % 64);
+    // Only the last word can be full
+    if(pool->nwords > 0 && pool->bits[pool->nwords - 1] == ~0ULL)
+        pool->summary[(pool->nwords - 1) / 64] |= 1ULL << ((pool->nwords - 1) % 64);
+}
+
+static void
+pool_geometry(ip_pool *pool, int size){
+    memset(pool, 0, sizeof(ip_pool));
+    pool->size = size;
+    pool->nfree = size;
+    pool->nwords = (size + 63) / 64;
+    pool->nsummary = (pool->nwords + 63) / 64;
 }
 
 /*
- * matchstar: search for c*regexp at beginning of text 
+ * Init the private pool bitmap for size addresses
  */
-int matchstar(int c, char *regexp, char *text)
-{
-	do {	/* a * matches zero or more instances */
-		if (matchhere(regexp, text))
-			return 1;
-	} while (*text != '\0' && (*text++ == c || c == '.'));
-	return 0;
+static int
+pool_init(ip_pool *pool, int size, arena *a){
+    pool_geometry(pool, size);
+    pool->bits = arena_alloc(a, (pool->nwords ? pool->nwords : 1) * sizeof(uint64_t));
+    pool->summary = arena_alloc(a, (pool->nsummary ? pool->nsummary : 1) * sizeof(uint64_t));
+    if(pool->bits == NULL || pool->summary == NULL)
+        return -1;
+    pool_pad(pool);
+    return 0;
 }
+
 /*
- * Need to lookup for the IP, then create the file
+ * Map the shared pool segment name for size addresses, the first instance
+ * to open it sets it up under an flock, the others check it matches
  */
 static int
-client_connect (struct plugin_context *context, const char *argv[], const char *envp[], struct plugin_per_client_context *client_ip){
-    int i;
-    const char *common_name = NULL;
-    common_name = strdup(get_env("common_name",envp));
-    printf("PLUGIN_REALM: common_name %s\n",common_name);
-    // For each subnet
-    for(i = 0; i< context->numRealm;i++){
-        char *regex = NULL;
-        regex = strdup(context->configs[i]->regex);
-        printf("PLUGIN_REALM: commonname - %s\n",common_name);
-        printf("PLUGIN_REALM: regex - %s\n",regex);
-        printf("PLUGIN_REALM: network - %s\n",context->configs[i]->network);
-        printf("PLUGIN_REALM: netmask - %s\n",context->configs[i]->netmask);
-            // Look if the common_name of the certificate correspond to the regex
-        if(match(regex, common_name )){
-            printf("PLUGIN_REALM: Match founded for %s in Realm Number %d with regex %s\n",common_name,i, regex);
-            char conf[256];
-            char filename[256];
-            FILE * file = NULL;
-            subnet_ip *ip = NULL;
-            ip = found_ip_realm(common_name,context->configs[i] );
-            // If we found an ip address
-            if(ip != NULL){
-                // filename
-                sprintf(filename,"%s%s",context->conf_dir,common_name);
-                // Configuration
-                sprintf(conf,"ifconfig-push %s %s",ip->address,context->configs[i]->netmask);
-                // Open the file
-                file = fopen(filename, "w+");
-                printf("PLUGIN_REALM: Configuration file generated for %s with ip %s\n",common_name,ip->address);
-                // Write the output file
-                fprintf(file, "ifconfig-push %s %s",ip->address,context->configs[i]->netmask);
-                fclose(file);
-                
-                // Edit the client context
-                client_ip->ip = ip;
-                client_ip->generated_conf_file = strdup(filename);
-                return OPENVPN_PLUGIN_FUNC_SUCCESS;
-            }else{
-                sprintf(filename,"%s%s",context->conf_dir,common_name);
-                unlink(filename);
-                return OPENVPN_PLUGIN_FUNC_ERROR;
-            }
-        }else{
-            printf("PLUGIN_REALM: No match founded for %s in Realm %d with regex %s",common_name, i,regex);
-        }
+pool_attach(ip_pool *pool, int size, const char *name, int id){
+    struct stat st;
+    pool_segment *segment;
+    void *map;
+    int fd;
+
+    pool_geometry(pool, size);
+    pool->id = id;
+    pool->map_size = sizeof(pool_segment) + (size_t)(pool->nwords + pool->nsummary) * sizeof(uint64_t) + size;
+    fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if(fd < 0){
+        realm_log(REALM_LOG_ERROR, "Could not open the shared pool %s: %s", name, strerror(errno));
+        return -1;
     }
-    return OPENVPN_PLUGIN_FUNC_ERROR;
+    if(flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0
+       || (st.st_size == 0 && ftruncate(fd, pool->map_size) != 0)){
+        realm_log(REALM_LOG_ERROR, "Could not set up the shared pool %s: %s", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if(st.st_size != 0 && (size_t) st.st_size != pool->map_size){
+        realm_log(REALM_LOG_ERROR, "The shared pool %s does not have %d addresses", name, size);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        realm_log(REALM_LOG_ERROR, "Could not map the shared pool %s: %s", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    segment = map;
+    pool->bits = (uint64_t *)(segment + 1);
+    pool->summary = pool->bits + pool->nwords;
+    pool->owner = (uint8_t *)(pool->summary + pool->nsummary);
+    if(__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != POOL_SEGMENT_MAGIC){
+        // New segment, or its creator died before setting it up
+        pool_pad(pool);
+        segment->version = POOL_SEGMENT_VERSION;
+        segment->size = size;
+        segment->nfree = size;
+        __atomic_store_n(&segment->magic, POOL_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+    }else if(segment->version != POOL_SEGMENT_VERSION || segment->size != size){
+        realm_log(REALM_LOG_ERROR, "The shared pool %s is not usable", name);
+        munmap(map, pool->map_size);
+        close(fd);
+        return -1;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    pool->shared = segment;
+    return 0;
+}
+
+static void
+pool_detach(ip_pool *pool){
+    if(pool->shared != NULL)
+        munmap(pool->shared, pool->map_size);
+    pool->shared = NULL;
 }
 
 /*
- * On client disconnection we need to clean the file
+ * Free addresses left in the pool, for all the instances when it is shared
  */
 static int
-client_disconnect (struct plugin_context *context, const char *argv[], const char *envp[], struct plugin_per_client_context *client_conf){
-      char filename[256];
-      if(client_conf->ip != NULL){
-          printf("PLUGIN_REALM_DISCONNECT: ip address %s", client_conf->ip->address);  
-          // Delete the file concerning the configuration
-          sprintf(filename,"%s%s",context->conf_dir,client_conf->ip->common_name);
-          unlink(filename);
-          // relase the ip in the global conf
-
-          client_conf->ip->common_name = NULL;
-          client_conf->ip->used = 0;
-      }
-      return OPENVPN_PLUGIN_FUNC_SUCCESS;
+pool_free_count(const ip_pool *pool){
+    if(pool->shared != NULL)
+        return __atomic_load_n(&pool->shared->nfree, __ATOMIC_RELAXED);
+    return pool->nfree;
+}
+
+/*
+ * Shared pool, word w became full: flag it in the summary, then clear the
+ * flag again if an address of the word was given back in between. A give
+ * back clears the bit then the flag, so a free address is never hidden.
+ */
+static void
+pool_mark_full(ip_pool *pool, int w){
+    uint64_t flag = 1ULL << (w % 64);
+    __atomic_fetch_or(&pool->summary[w / 64], flag, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&pool->bits[w], __ATOMIC_SEQ_CST) != ~0ULL)
+        __atomic_fetch_and(&pool->summary[w / 64], ~flag, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Shared pool, the bits of mask were just set in word w by this instance
+ */
+static void
+pool_shared_taken(ip_pool *pool, int w, uint64_t mask, uint64_t word, uint8_t owner){
+    uint64_t bits = mask;
+    while(bits){
+        __atomic_store_n(&pool->owner[w * 64 + __builtin_ctzll(bits)], owner, __ATOMIC_RELEASE);
+        bits &= bits - 1;
+    }
+    if((word | mask) == ~0ULL)
+        pool_mark_full(pool, w);
+    __atomic_fetch_sub(&pool->shared->nfree, __builtin_popcountll(mask), __ATOMIC_RELAXED);
 }
 
 /*
- * Number of line in a file (used to know how many configuration) 
+ * Shared pool, give back an address if it still belongs to owner
  */
 static int
-get_nb_line(char *file_name){
-    FILE *fh = fopen(file_name, "r");
-    int lines = 0;
-    char line[1024];
-    lines = 0;
-    while( fgets(line,sizeof(line),fh) != NULL)
-       lines++;
-    fclose(fh);
-    return lines;
+pool_shared_give_back(ip_pool *pool, int index, uint8_t owner){
+    int w = index / 64;
+    if(!__atomic_compare_exchange_n(&pool->owner[index], &owner, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return -1;
+    __atomic_fetch_and(&pool->bits[w], ~(1ULL << (index % 64)), __ATOMIC_SEQ_CST);
+    __atomic_fetch_and(&pool->summary[w / 64], ~(1ULL << (w % 64)), __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&pool->shared->nfree, 1, __ATOMIC_RELAXED);
+    return 0;
 }
 
 /*
- * Generate the subnet in the memory, this way when we need to look up for an ip, we just have to look inside an array
+ * Shared pool allocation: the same walk as the private one, with a compare
+ * and swap to take the bit. The hint is local to the instance and the
+ * others give addresses back behind it, so the walk wraps around.
  */
-static int 
-generate_subnet(struct plugin_context *context, const char *argv[], const char *envp[])
-{
-    int count,compter,i,j,k;
-    char buf[256];
-
-    // For each subnet
-    for(i = 0; i < context->numRealm;i++){
-        count = (context->configs[i]->end[2] - context->configs[i]->start[2] + 1) * (context->configs[i]->end[3] - context->configs[i]->start[3] + 1);
-        printf("PLUGIN_REALM: NUM SUBNET %d\n\n",count);
-        context->configs[i]->subnet = malloc(count * sizeof(subnet_ip *));
-        compter = 0;
-        
-        for(j = context->configs[i]->start[2]; j <= context->configs[i]->end[2] ; j++){
-            for(k = context->configs[i]->start[3]; k <= context->configs[i]->end[3] ; k++){
-                // Do not give the subnet address
-                if(j == context->configs[i]->start[2] && k == context->configs[i]->start[3]){
-                    printf("PLUGIN_REALM: Address Ip network: %d.%d.%d.%d\n",context->configs[i]->start[0],context->configs[i]->start[1],j,k);
-                }
-                // Do not give the first address
-                else if(j == context->configs[i]->start[2] && k == context->configs[i]->start[3] + 1){
-                     printf("PLUGIN_REALM: Address Ip Gateway network: %d.%d.%d.%d\n",context->configs[i]->start[0],context->configs[i]->start[1],j,k);
-                }
-                // Do not give the netmask address
-                else if(j == context->configs[i]->end[2] && k == context->configs[i]->end[3]){
-                     printf("PLUGIN_REALM: Address Brodcast network: %d.%d.%d.%d\n",context->configs[i]->start[0],context->configs[i]->start[1],j,k);
-                }
-                else if(j == context->configs[i]->end[2] && k == context->configs[i]->end[3]-1){
-                     printf("PLUGIN_REALM: Address DHCP network: %d.%d.%d.%d\n",context->configs[i]->start[0],context->configs[i]->start[1],j,k);
-                }
-                else{
-                    context->configs[i]->subnet[compter] = malloc(sizeof(subnet_ip));
-                    context->configs[i]->subnet[compter]->used = 0;
-                    sprintf(buf,"%d.%d.%d.%d",context->configs[i]->start[0],context->configs[i]->start[1],j,k);
-                    context->configs[i]->subnet[compter]->address = strdup(buf);
-                    compter++;
+static int
+pool_alloc_shared(ip_pool *pool){
+    int n;
+    for(n = 0; n < pool->nsummary; n++){
+        int s = (pool->hint + n) % pool->nsummary;
+        uint64_t summary = __atomic_load_n(&pool->summary[s], __ATOMIC_ACQUIRE);
+        while(summary != ~0ULL){
+            int w = s * 64 + __builtin_ctzll(~summary);
+            uint64_t word = __atomic_load_n(&pool->bits[w], __ATOMIC_ACQUIRE);
+            while(word != ~0ULL){
+                uint64_t bit = 1ULL << __builtin_ctzll(~word);
+                // word is reloaded when another instance was faster
+                if(__atomic_compare_exchange_n(&pool->bits[w], &word, word | bit, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+                    pool_shared_taken(pool, w, bit, word, (uint8_t) pool->id);
+                    pool->nused++;
+                    pool->hint = s;
+                    return w * 64 + __builtin_ctzll(bit);
                 }
             }
+            pool_mark_full(pool, w);
+            summary |= 1ULL << (w % 64);
         }
     }
-    return 0;
+    return -1;
 }
 
 /*
- * Generate the configuration
+ * Take the first free address of the pool, return its index or -1 if full
  */
 static int
-get_config(struct plugin_context *context, const char *argv[], const char *envp[])
-{
-    FILE *fh = fopen(context->plugin_conf, "r");
-    char * line = NULL;
-    char * buf = NULL;
-    int i,j;
-    size_t len = 0;
-    ssize_t read;
-    context->configs = malloc(context->numRealm * sizeof(realm_conf **) );
-    i=0;
-    // read for the realm_conf
-    while ((read = getline(&line, &len, fh)) != -1) {
-        buf = strtok(line, "#");
-        context->configs[i] = malloc(sizeof(realm_conf *) );
-        for(j = 0 ; j < NUM_PARAM_CONF; j++){
-            switch (j)
-                {
-                case INDEX_REGEX:
-                  context->configs[i]->regex = strdup(buf);
-                  break;
-                case INDEX_NETWORK:
-                  context->configs[i]->network = strdup(buf);
-                  break;
-                case INDEX_NETMASK:
-                  context->configs[i]->netmask = strdup(buf);
-                  break;
-            }
-            buf = strtok(NULL, "#");
+pool_alloc(ip_pool *pool){
+    int s, w, b;
+    if(pool->shared != NULL)
+        return pool_alloc_shared(pool);
+    for(s = pool->hint; s < pool->nsummary; s++){
+        if(pool->summary[s] == ~0ULL){
+            pool->hint = s + 1;
+            continue;
         }
-        i++;
+        w = s * 64 + __builtin_ctzll(~pool->summary[s]);
+        b = __builtin_ctzll(~pool->bits[w]);
+        pool->bits[w] |= 1ULL << b;
+        if(pool->bits[w] == ~0ULL)
+            pool->summary[s] |= 1ULL << (w % 64);
+        pool->nfree--;
+        pool->nused++;
+        return w * 64 + b;
     }
-    fclose(fh);
-    printf("====================== REALM CONF ======================\n");
-    for(i= 0; i< context->numRealm; i++){
-        // make start
-        char *netmaskTMP = strdup(context->configs[i]->netmask);
-        char *addressTMP = strdup(context->configs[i]->network);
-        char *regexTMP = strdup(context->configs[i]->regex);
-        printf("Realm number %d\n",i+1);
-        printf("Regex  %s\n",regexTMP);
-        printf("network  %s\n",addressTMP);
-        printf("netmask  %s\n",netmaskTMP);
-        
-        buf = strtok(addressTMP, ".");
-        for(j = 0;j < 4; j++){
-            context->configs[i]->start[j] = atoi(buf);
-            buf = strtok(NULL, ".");
-        }
-        // make end
-        buf = strtok(netmaskTMP, ".");
-        for(j = 0;j < 4; j++){
-            context->configs[i]->end[j] = context->configs[i]->start[j] + 255 - atoi(buf);
-            buf = strtok(NULL, ".");
-        }
-    }
-    
-    
+    return -1;
+}
+
+/*
+ * Take a given address of the pool, return -1 if it is already used
+ */
+static int
+pool_take(ip_pool *pool, int index){
+    int w = index / 64;
+    uint64_t bit = 1ULL << (index % 64);
+    if(pool->shared != NULL){
+        uint64_t word = __atomic_fetch_or(&pool->bits[w], bit, __ATOMIC_ACQ_REL);
+        if(word & bit)
+            return -1;
+        pool_shared_taken(pool, w, bit, word, (uint8_t) pool->id);
+        pool->nused++;
+        return 0;
+    }
+    if(pool->bits[w] & bit)
+        return -1;
+    pool->bits[w] |= bit;
+    if(pool->bits[w] == ~0ULL)
+        pool->summary[w / 64] |= 1ULL << (w % 64);
+    pool->nfree--;
+    pool->nused++;
     return 0;
 }
 
-OPENVPN_EXPORT openvpn_plugin_handle_t
-openvpn_plugin_open_v1 (unsigned int *type_mask, const char *argv[], const char *envp[])
-{
-    struct plugin_context *context;
-    int i;
-    /*
-     *    Allocate our context
-     */
-    context = (struct plugin_context *) calloc (1, sizeof (struct plugin_context))    ;
-    printf("PLUGIN_REALM: PLUGIN_CONFIGURATION\n");
-    context->plugin_conf = strdup(argv[1]);
-    printf("PLUGIN_REALM: PLUGIN_CONFIGURATION_FILE: %s\n",strdup(argv[1] ));
-    context->conf_dir = strdup(argv[2]);
-    printf("PLUGIN_REALM: PLUGIN_CONFIGURATION_DIR: %s\n",strdup(argv[2]) );
+static void
+pool_clear(ip_pool *pool, int index){
+    int w = index / 64;
+    if(!(pool->bits[w] & (1ULL << (index % 64))))
+        return;
+    pool->bits[w] &= ~(1ULL << (index % 64));
+    pool->summary[w / 64] &= ~(1ULL << (w % 64));
+    if(w / 64 < pool->hint)
+        pool->hint = w / 64;
+    pool->nfree++;
+}
 
-    context->numRealm = get_nb_line(context->plugin_conf);
-    // Fetch the configuration
-    i = get_config (context, argv, envp);
-    // Generate the subnet
-    i = generate_subnet(context, argv, envp);
-    /*
-     *  We are only interested in intercepting the
-     *  --auth-user-pass-verify callback.
-     */
-    *type_mask =
-    
-    OPENVPN_PLUGIN_MASK (OPENVPN_PLUGIN_IPCHANGE) |
-    OPENVPN_PLUGIN_MASK (OPENVPN_PLUGIN_CLIENT_DISCONNECT);
+/*
+ * Give the address back to the pool
+ */
+static void
+pool_release(ip_pool *pool, int index){
+    pool->nused--;
+    if(pool->shared != NULL)
+        pool_shared_give_back(pool, index, (uint8_t) pool->id);
+    else
+        pool_clear(pool, index);
+}
 
-    return (openvpn_plugin_handle_t) context;
+/*
+ * An address taken by a client stays out of the pool as an excluded one,
+ * only for a private pool
+ */
+static void
+pool_exclude(ip_pool *pool, int index){
+    pool->nused--;
 }
 
-OPENVPN_EXPORT int
-openvpn_plugin_func_v2 (openvpn_plugin_handle_t handle,
-			const int type,
-			const char *argv[],
-			const char *envp[],
-			void *per_client_context,
-			struct openvpn_plugin_string_list **return_list)
-{
-    struct plugin_context *context = (struct plugin_context *) handle;
-    struct plugin_per_client_context *client_conf = (struct plugin_per_client_context *) per_client_context;
-    switch (type)
-        { 
-        case OPENVPN_PLUGIN_IPCHANGE:
-            printf ("PLUGIN_REALM: OPENVPN_PLUGIN_IPCHANGE\n");
-            return  client_connect (context, argv, envp, client_conf);
-        case OPENVPN_PLUGIN_CLIENT_DISCONNECT:
-            printf ("PLUGIN_REALM: OPENVPN_PLUGIN_CLIENT_DISCONNECT\n");
-            return  client_disconnect (context, argv, envp, client_conf);
-        default:
-            printf ("PLUGIN_REALM: OPENVPN_PLUGIN_?\n");
-            return OPENVPN_PLUGIN_FUNC_ERROR;
+/*
+ * An excluded address goes back to the pool
+ */
+static void
+pool_unexclude(ip_pool *pool, int index){
+    pool_clear(pool, index);
+}
+
+/*
+ * Take every free address from first to last, a word at a time, and set
+ * the bits of the addresses taken in mark
+ */
+static int
+pool_take_range(ip_pool *pool, int first, int last, uint64_t *mark){
+    int w, taken = 0;
+    for(w = first / 64; w <= last / 64; w++){
+        uint64_t mask = ~0ULL;
+        if(w == first / 64)
+            mask &= ~0ULL << (first % 64);
+        if(w == last / 64 && last % 64 != 63)
+            mask &= ~(~0ULL << (last % 64 + 1));
+        mask &= ~mark[w] & ~pool->bits[w];
+        pool->bits[w] |= mask;
+        if(pool->bits[w] == ~0ULL)
+            pool->summary[w / 64] |= 1ULL << (w % 64);
+        pool->nfree -= __builtin_popcountll(mask);
+        mark[w] |= mask;
+        taken += __builtin_popcountll(mask);
     }
+    return taken;
 }
 
-OPENVPN_EXPORT void *
-openvpn_plugin_client_constructor_v1 (openvpn_plugin_handle_t handle)
-{
-  printf ("PLUGIN_REALM: openvpn_plugin_client_constructor_v1\n");
-  return calloc (1, sizeof (struct plugin_per_client_context));
+/*
+ * Shared pool, take back the addresses left under the id of this instance
+ * by a previous run, before its leases are restored
+ */
+static int
+pool_reclaim(ip_pool *pool){
+    int w, reclaimed = 0;
+    for(w = 0; w < pool->nwords; w++){
+        uint64_t used = __atomic_load_n(&pool->bits[w], __ATOMIC_ACQUIRE);
+        // The padding bits have no owner
+        if(w == pool->nwords - 1 && pool->size % 64)
+            used &= ~(~0ULL << (pool->size % 64));
+        for(; used; used &= used - 1)
+            if(pool_shared_give_back(pool, w * 64 + __builtin_ctzll(used), (uint8_t) pool->id) == 0)
+                reclaimed++;
+    }
+    return reclaimed;
 }
 
-OPENVPN_EXPORT void
-openvpn_plugin_client_destructor_v1 (openvpn_plugin_handle_t handle, void *per_client_context)
-{
-    printf ("PLUGIN_REALM: openvpn_plugin_client_destructor_v1\n");
-    if(per_client_context != NULL){
-        free (per_client_context);
+static int
+is_reserved(const struct realm_conf *conf, int index){
+    return (conf->reserved[index / 64] >> (index % 64)) & 1;
+}
+
+static void
+set_reserved(struct realm_conf *conf, int index, int reserved){
+    if(is_reserved(conf, index) == reserved)
+        return;
+    if(reserved)
+        conf->reserved[index / 64] |= 1ULL << (index % 64);
+    else
+        conf->reserved[index / 64] &= ~(1ULL << (index % 64));
+    conf->nreserved += reserved ? 1 : -1;
+}
+
+static int
+range_cmp(const void *a, const void *b){
+    const addr_range *ra = a, *rb = b;
+    return ra->first < rb->first ? -1 : ra->first > rb->first;
+}
+
+static int
+range_contains(const addr_range *ranges, int n, uint32_t index){
+    int lo = 0, hi = n - 1;
+    while(lo <= hi){
+        int mid = (lo + hi) / 2;
+        if(index < ranges[mid].first)
+            hi = mid - 1;
+        else if(index > ranges[mid].last)
+            lo = mid + 1;
+        else
+            return 1;
+    }
+    return 0;
+}
+
+static int
+is_excluded(const struct realm_conf *conf, int index){
+    return (conf->excluded[index / 64] >> (index % 64)) & 1;
+}
+
+/*
+ * No client and no orphan in the realm anymore
+ */
+static int
+realm_idle(const struct realm_conf *conf){
+    return conf->pool.nused == 0;
+}
+
+/*
+ * Turn the excluded addresses of the configuration in pool indexes: the
+ * ranges are clipped to the pool, sorted and merged
+ */
+static void
+exclude_normalize(struct realm_conf *conf){
+    uint32_t last_addr = conf->first_addr + conf->pool.size - 1;
+    int i, n = 0;
+
+    for(i = 0; i < conf->nexclude; i++){
+        addr_range r = conf->exclude[i];
+        if(r.last < conf->first_addr || r.first > last_addr)
+            continue;
+        r.first = (r.first < conf->first_addr ? conf->first_addr : r.first) - conf->first_addr;
+        r.last = (r.last > last_addr ? last_addr : r.last) - conf->first_addr;
+        conf->exclude[n++] = r;
+    }
+    // exclude is NULL without exclusions
+    if(n > 1)
+        qsort(conf->exclude, n, sizeof(addr_range), range_cmp);
+    conf->nexclude = 0;
+    for(i = 0; i < n; i++){
+        addr_range *prev = conf->nexclude ? &conf->exclude[conf->nexclude - 1] : NULL;
+        if(prev != NULL && conf->exclude[i].first <= prev->last + 1){
+            if(conf->exclude[i].last > prev->last)
+                prev->last = conf->exclude[i].last;
+        }else{
+            conf->exclude[conf->nexclude++] = conf->exclude[i];
+        }
+    }
+}
+
+/*
+ * Keep the free addresses of the excluded ranges out of the pool, the ones
+ * in use are excluded when their client leaves
+ */
+static void
+exclude_apply(struct realm_conf *conf){
+    int i;
+    for(i = 0; i < conf->nexclude; i++)
+        conf->nexcluded += pool_take_range(&conf->pool, conf->exclude[i].first, conf->exclude[i].last, conf->excluded);
+}
+
+/*
+ * Bits of the word w of a bitmap covered by the range
+ */
+static uint64_t
+range_word(const addr_range *range, uint32_t w){
+    uint64_t mask = ~0ULL;
+    if(range->first > w * 64)
+        mask &= ~0ULL << (range->first % 64);
+    if(range->last < w * 64 + 63)
+        mask &= ~(~0ULL << (range->last % 64 + 1));
+    return mask;
+}
+
+/*
+ * Bits of the word w covered by the sorted ranges, *next is the first
+ * range that can still reach w and only moves forward
+ */
+static uint64_t
+ranges_word(const addr_range *ranges, int n, int *next, uint32_t w){
+    uint64_t mask = 0;
+    int i;
+    while(*next < n && ranges[*next].last < w * 64)
+        (*next)++;
+    for(i = *next; i < n && ranges[i].first <= w * 64 + 63; i++)
+        mask |= range_word(&ranges[i], w);
+    return mask;
+}
+
+/*
+ * The exclusions of a realm carried over by a reload changed: the addresses
+ * that are not excluded anymore (old & ~new, a word at a time) go back to
+ * the pool, then the new ranges are applied. The realm takes the new list
+ * and gives back the old one.
+ */
+static void
+exclude_update(struct realm_conf *conf, addr_range **exclude, int *nexclude){
+    addr_range *old = conf->exclude;
+    int nold = conf->nexclude, i, next = 0;
+    uint32_t w;
+
+    // Most reloads leave the exclusions alone
+    if(nold == *nexclude && (nold == 0 || !memcmp(old, *exclude, nold * sizeof(addr_range))))
+        return;
+    for(i = 0; i < nold; i++){
+        for(w = old[i].first / 64; w <= old[i].last / 64; w++){
+            uint64_t drop = conf->excluded[w] & range_word(&old[i], w) & ~ranges_word(*exclude, *nexclude, &next, w);
+            conf->excluded[w] &= ~drop;
+            conf->nexcluded -= __builtin_popcountll(drop);
+            for(; drop; drop &= drop - 1)
+                pool_unexclude(&conf->pool, w * 64 + __builtin_ctzll(drop));
+        }
+    }
+    conf->exclude = *exclude;
+    conf->nexclude = *nexclude;
+    *exclude = old;
+    *nexclude = nold;
+    exclude_apply(conf);
+}
+
+/*
+ * An address given back by a client or an orphan: to the pool, or kept
+ * out when it was excluded in the meantime
+ */
+static void
+realm_release(struct realm_conf *conf, int index){
+    if(range_contains(conf->exclude, conf->nexclude, index)){
+        conf->excluded[index / 64] |= 1ULL << (index % 64);
+        conf->nexcluded++;
+        pool_exclude(&conf->pool, index);
+    }else{
+        pool_release(&conf->pool, index);
+    }
+}
+
+/*
+ * Dotted quad of an address, in buf
+ */
+static char *
+format_address(uint32_t address, char *buf){
+    char *p = buf;
+    int shift;
+    for(shift = 24; shift >= 0; shift -= 8){
+        unsigned int byte = address >> shift & 0xff;
+        if(byte >= 100)
+            *p++ = '0' + byte / 100;
+        if(byte >= 10)
+            *p++ = '0' + byte / 10 % 10;
+        *p++ = '0' + byte % 10;
+        *p++ = shift ? '.' : '\0';
+    }
+    return buf;
+}
+
+/*
+ * Take the first free address of the window addresses from start, wrapping
+ * at the end of the pool, a bitmap word at a time. Return its index or -1.
+ */
+static int
+pool_alloc_near(ip_pool *pool, int start, int window){
+    int index = start;
+    while(window > 0){
+        int n = 64 - index % 64;
+        uint64_t mask, free;
+        if(n > window)
+            n = window;
+        if(n > pool->size - index)
+            n = pool->size - index;
+        mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << (index % 64);
+        free = ~__atomic_load_n(&pool->bits[index / 64], __ATOMIC_RELAXED) & mask;
+        // Another instance may take it first in a shared pool
+        while(free){
+            int found = index / 64 * 64 + __builtin_ctzll(free);
+            if(pool_take(pool, found) == 0)
+                return found;
+            free &= free - 1;
+        }
+        window -= n;
+        index = index + n == pool->size ? 0 : index + n;
+    }
+    return -1;
+}
+
+/*
+ * Hashed addresses: the common name goes through a finalizer and is scaled
+ * to the pool, so each server of a cluster gives a client the same address
+ * without sharing anything, and gives it back after a restart. Collisions
+ * are probed linearly over HASH_PROBE_WINDOW addresses, one or two bitmap
+ * words; a client that finds them all used gets the first free address.
+ */
+#define HASH_PROBE_WINDOW 64
+
+static int
+hash_slot(uint32_t hash, int size){
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return (int)(((uint64_t) hash * (uint32_t) size) >> 32);
+}
+
+/*
+ * Found an ip address available in the realm for the common name of the
+ * given lease_hash, return its index or -1
+ */
+static int
+found_ip_realm(struct realm_conf *conf, uint32_t hash){
+    realm_log(REALM_LOG_DEBUG, "found_ip_realm %s netmask", conf->network);
+    if(conf->policy == REALM_POLICY_HASH){
+        int index = pool_alloc_near(&conf->pool, hash_slot(hash, conf->pool.size), HASH_PROBE_WINDOW);
+        if(index >= 0)
+            return index;
+        realm_log(REALM_LOG_DEBUG, "No free address near the hash in %s, taking the first free one", conf->network);
+    }
+    return pool_alloc(&conf->pool);
+}
+
+/*
+ * Lease store: the address of each common name is kept in a memory mapped
+ * file next to plugin.conf, so a restarted server gives clients their
+ * previous address back. The file is an open addressing hash table keyed
+ * by common name, updated in place on connect and disconnect and used as
+ * is on reload, without any parsing.
+ *
+ * A record is bound to a realm and an address with a single 64 bits store
+ * and its state is written last, so a crash of the process in the middle
+ * of an update leaves either the old or the new lease, never a mix.
+ */
+#define LEASE_MAGIC 0x4c454153
+#define LEASE_VERSION 1
+#define LEASE_CN_SIZE COMMON_NAME_SIZE
+#define LEASE_MIN_CAPACITY 1024
+// A new file is sized for the addresses of the realms up to this, it grows after
+#define LEASE_MAX_PRESIZE 65536
+
+#define LEASE_EMPTY 0
+#define LEASE_ACTIVE 1
+#define LEASE_RELEASED 2
+
+typedef struct lease_header{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t reserved[3];
+}lease_header;
+
+typedef struct lease_record{
+    uint32_t state;
+    uint32_t hash;
+    uint64_t binding;   // realm network << 32 | address
+    uint64_t stamp;
+    char common_name[LEASE_CN_SIZE];
+}lease_record;
+
+typedef struct lease_store{
+    char *path;
+    int fd;
+    size_t map_size;
+    lease_header *header;
+    lease_record *records;
+}lease_store;
+
+static uint32_t
+lease_hash(const char *common_name){
+    uint32_t h = 2166136261u;
+    for(; *common_name; common_name++){
+        h ^= (unsigned char) *common_name;
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+static size_t
+lease_map_size(uint32_t capacity){
+    return sizeof(lease_header) + (size_t)capacity * sizeof(lease_record);
+}
+
+/*
+ * Map the lease file, creating it with capacity records when it is missing
+ * or not usable
+ */
+static int
+lease_map(lease_store *store, const char *path, uint32_t capacity){
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    void *map;
+
+    if(fd < 0)
+        return -1;
+    if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(lease_header)){
+        lease_header header;
+        if(pread(fd, &header, sizeof(header), 0) == sizeof(header)
+           && header.magic == LEASE_MAGIC && header.version == LEASE_VERSION
+           && header.record_size == sizeof(lease_record)
+           && header.capacity >= LEASE_MIN_CAPACITY && !(header.capacity & (header.capacity - 1))
+           && (size_t)st.st_size == lease_map_size(header.capacity)){
+            capacity = header.capacity;
+        }else{
+            realm_log(REALM_LOG_WARN, "Lease file %s is not valid, starting with no lease", path);
+            st.st_size = 0;
+        }
+    }else{
+        st.st_size = 0;
+    }
+    if(st.st_size == 0){
+        lease_header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = LEASE_MAGIC;
+        header.version = LEASE_VERSION;
+        header.record_size = sizeof(lease_record);
+        header.capacity = capacity;
+        if(ftruncate(fd, 0) != 0 || ftruncate(fd, lease_map_size(capacity)) != 0
+           || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)){
+            close(fd);
+            return -1;
+        }
+    }
+    map = mmap(NULL, lease_map_size(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        close(fd);
+        return -1;
+    }
+    store->fd = fd;
+    store->map_size = lease_map_size(capacity);
+    store->header = map;
+    store->records = (lease_record *)((char *) map + sizeof(lease_header));
+    return 0;
+}
+
+static void
+lease_unmap(lease_store *store){
+    if(store->header != NULL){
+        msync(store->header, store->map_size, MS_ASYNC);
+        munmap(store->header, store->map_size);
+        close(store->fd);
+    }
+    store->header = NULL;
+    store->records = NULL;
+}
+
+/*
+ * Find the record of the common name, or the empty slot where it goes
+ */
+static lease_record *
+lease_slot(lease_store *store, const char *common_name, uint32_t hash){
+    uint32_t mask = store->header->capacity - 1;
+    uint32_t i = hash & mask;
+    lease_record *rec;
+    for(;;){
+        rec = &store->records[i];
+        if(rec->state == LEASE_EMPTY)
+            return rec;
+        if(rec->hash == hash && !strncmp(rec->common_name, common_name, LEASE_CN_SIZE))
+            return rec;
+        i = (i + 1) & mask;
+    }
+}
+
+/*
+ * Return the lease of the common name, NULL if it never had one
+ */
+static lease_record *
+lease_lookup(lease_store *store, const char *common_name){
+    lease_record *rec;
+    if(store == NULL || strlen(common_name) >= LEASE_CN_SIZE)
+        return NULL;
+    rec = lease_slot(store, common_name, lease_hash(common_name));
+    return rec->state == LEASE_EMPTY ? NULL : rec;
+}
+
+/*
+ * Double the capacity of the file: the records are rehashed in a new file
+ * which then replaces the old one
+ */
+static int
+lease_grow(lease_store *store){
+    lease_store bigger;
+    char tmp[PATH_MAX];
+    uint32_t i;
+
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", store->path) >= (int) sizeof(tmp))
+        return -1;
+    unlink(tmp);
+    memset(&bigger, 0, sizeof(bigger));
+    if(lease_map(&bigger, tmp, store->header->capacity * 2) != 0)
+        return -1;
+    for(i = 0; i < store->header->capacity; i++){
+        lease_record *rec = &store->records[i];
+        if(rec->state != LEASE_EMPTY){
+            *lease_slot(&bigger, rec->common_name, rec->hash) = *rec;
+            bigger.header->count++;
+        }
+    }
+    msync(bigger.header, bigger.map_size, MS_SYNC);
+    if(rename(tmp, store->path) != 0){
+        lease_unmap(&bigger);
+        unlink(tmp);
+        return -1;
+    }
+    lease_unmap(store);
+    store->fd = bigger.fd;
+    store->map_size = bigger.map_size;
+    store->header = bigger.header;
+    store->records = bigger.records;
+    return 0;
+}
+
+/*
+ * Record that the common name now holds the address in the realm
+ */
+static void
+lease_bind(lease_store *store, const char *common_name, uint32_t network, uint32_t address){
+    size_t len = strlen(common_name);
+    uint32_t hash;
+    lease_record *rec;
+
+    if(store == NULL || len >= LEASE_CN_SIZE)
+        return;
+    hash = lease_hash(common_name);
+    rec = lease_slot(store, common_name, hash);
+    if(rec->state == LEASE_EMPTY){
+        // Keep the table at most 3/4 full
+        if((store->header->count + 1) * 4 > store->header->capacity * 3){
+            if(lease_grow(store) != 0)
+                realm_log(REALM_LOG_WARN, "Could not grow the lease file %s", store->path);
+            rec = lease_slot(store, common_name, hash);
+            if(rec->state == LEASE_EMPTY && (store->header->count + 1) * 4 > store->header->capacity * 3)
+                return;
+        }
+        memcpy(rec->common_name, common_name, len);
+        memset(rec->common_name + len, 0, LEASE_CN_SIZE - len);
+        rec->hash = hash;
+        store->header->count++;
+    }
+    __atomic_store_n(&rec->binding, (uint64_t) network << 32 | address, __ATOMIC_RELEASE);
+    rec->stamp = (uint64_t) time(NULL);
+    __atomic_store_n(&rec->state, LEASE_ACTIVE, __ATOMIC_RELEASE);
+}
+
+/*
+ * The common name released the address, the lease is kept so the same
+ * address is given back if it is still free when the client comes back
+ */
+static void
+lease_release(lease_store *store, const char *common_name, uint32_t network, uint32_t address){
+    lease_record *rec = lease_lookup(store, common_name);
+    // A later connection with the same common name may own the lease now
+    if(rec == NULL || rec->binding != ((uint64_t) network << 32 | address))
+        return;
+    rec->stamp = (uint64_t) time(NULL);
+    __atomic_store_n(&rec->state, LEASE_RELEASED, __ATOMIC_RELEASE);
+}
+
+static void
+lease_close(lease_store *store){
+    if(store == NULL)
+        return;
+    lease_unmap(store);
+    free(store->path);
+    free(store);
+}
+
+static int
+realm_network_cmp(const void *a, const void *b){
+    const realm_conf *ra = *(realm_conf * const *) a;
+    const realm_conf *rb = *(realm_conf * const *) b;
+    return ra->network_addr < rb->network_addr ? -1 : ra->network_addr > rb->network_addr;
+}
+
+/*
+ * Realm of the address. The realms are not expected to overlap, only the
+ * last realm starting at or below the address is checked.
+ */
+static realm_conf *
+realm_of_address(struct plugin_context *context, uint32_t address){
+    int lo = 0, hi = context->numRealm - 1, found = -1;
+    realm_conf *realm;
+
+    while(lo <= hi){
+        int mid = (lo + hi) / 2;
+        if(context->by_network[mid]->network_addr <= address){
+            found = mid;
+            lo = mid + 1;
+        }else{
+            hi = mid - 1;
+        }
+    }
+    if(found < 0)
+        return NULL;
+    realm = context->by_network[found];
+    return (uint64_t) (address - realm->network_addr) < (1ULL << (32 - realm->prefix)) ? realm : NULL;
+}
+
+/*
+ * Open the lease file of the plugin and reserve the address of every
+ * client that was connected when the server stopped, until it comes back
+ */
+static lease_store *
+lease_open(struct plugin_context *context){
+    lease_store *store = calloc(1, sizeof(lease_store));
+    uint32_t capacity = LEASE_MIN_CAPACITY;
+    uint64_t total = 0;
+    uint32_t i;
+    size_t size;
+    int restored = 0, n;
+
+    if(store == NULL)
+        return NULL;
+    // Each instance sharing the pools keeps its own leases
+    size = strlen(context->plugin_conf) + sizeof(".leases.255");
+    store->path = malloc(size);
+    if(store->path == NULL){
+        free(store);
+        return NULL;
+    }
+    if(context->shm != NULL)
+        n = snprintf(store->path, size, "%s.leases.%d", context->plugin_conf, context->shm_id);
+    else
+        n = snprintf(store->path, size, "%s.leases", context->plugin_conf);
+    if(n < 0 || (size_t) n >= size){
+        realm_log(REALM_LOG_WARN, "Could not name the lease file of %s", context->plugin_conf);
+        free(store->path);
+        free(store);
+        return NULL;
+    }
+    for(i = 0; i < (uint32_t) context->numRealm; i++)
+        total += context->configs[i]->pool.size;
+    while(capacity < 2 * total && capacity < LEASE_MAX_PRESIZE)
+        capacity *= 2;
+    if(lease_map(store, store->path, capacity) != 0){
+        realm_log(REALM_LOG_WARN, "Could not open the lease file %s", store->path);
+        free(store->path);
+        free(store);
+        return NULL;
+    }
+
+    for(i = 0; i < store->header->capacity; i++){
+        lease_record *rec = &store->records[i];
+        realm_conf key, *keyp = &key, **found;
+        uint32_t address;
+        int index;
+
+        if(rec->state != LEASE_ACTIVE)
+            continue;
+        key.network_addr = (uint32_t)(rec->binding >> 32);
+        address = (uint32_t) rec->binding;
+        found = bsearch(&keyp, context->by_network, context->numRealm, sizeof(realm_conf *), realm_network_cmp);
+        index = found ? (int)(address - (*found)->first_addr) : -1;
+        if(found == NULL || address < (*found)->first_addr || index >= (*found)->pool.size
+           || pool_take(&(*found)->pool, index) != 0){
+            // The realm is gone or the address is not in it anymore
+            rec->state = LEASE_RELEASED;
+            continue;
+        }
+        rec->common_name[LEASE_CN_SIZE - 1] = '\0';
+        if((*found)->norphans == (*found)->orphans_size){
+            int size = (*found)->orphans_size ? 2 * (*found)->orphans_size : 64;
+            realm_orphan *orphans = realloc((*found)->orphans, size * sizeof(realm_orphan));
+            if(orphans == NULL){
+                pool_release(&(*found)->pool, index);
+                rec->state = LEASE_RELEASED;
+                continue;
+            }
+            (*found)->orphans = orphans;
+            (*found)->orphans_size = size;
+        }
+        // The common name lives as long as the realm
+        (*found)->orphans[(*found)->norphans].common_name = arena_strdup(&(*found)->arena, rec->common_name);
+        if((*found)->orphans[(*found)->norphans].common_name == NULL){
+            pool_release(&(*found)->pool, index);
+            rec->state = LEASE_RELEASED;
+            continue;
+        }
+        (*found)->orphans[(*found)->norphans++].index = index;
+        set_reserved(*found, index, 1);
+        restored++;
+    }
+    realm_log(REALM_LOG_INFO, "%d leases restored from %s", restored, store->path);
+    return store;
+}
+
+/*
+ * Take back an address reserved for a client that did not come back since
+ * the restart
+ */
+static int
+reclaim_ip_realm(struct plugin_context *context, struct realm_conf *conf){
+    while(conf->norphans > 0){
+        realm_orphan *orphan = &conf->orphans[--conf->norphans];
+        if(!is_reserved(conf, orphan->index))
+            continue;
+        realm_log(REALM_LOG_DEBUG, "Taking back address %d of %s reserved for %s", orphan->index, conf->network, orphan->common_name);
+        lease_release(context->leases, orphan->common_name, conf->network_addr, conf->first_addr + orphan->index);
+        set_reserved(conf, orphan->index, 0);
+        if(range_contains(conf->exclude, conf->nexclude, orphan->index)){
+            realm_release(conf, orphan->index);
+            continue;
+        }
+        return orphan->index;
+    }
+    return -1;
+}
+
+/*
+ * Slot of the common name, or the empty slot where it goes
+ */
+static cn_slot *
+cn_index_slot(cn_index *idx, const char *common_name, uint32_t hash){
+    uint32_t mask = idx->capacity - 1;
+    uint32_t i = hash & mask;
+    while(idx->slots[i].item != NULL){
+        if(idx->slots[i].hash == hash && !strcmp((const char *) idx->slots[i].item + idx->name_offset, common_name))
+            return &idx->slots[i];
+        i = (i + 1) & mask;
+    }
+    return &idx->slots[i];
+}
+
+static void *
+cn_index_find(cn_index *idx, const char *common_name, uint32_t hash){
+    if(idx->count == 0)
+        return NULL;
+    return cn_index_slot(idx, common_name, hash)->item;
+}
+
+static int
+cn_index_grow(cn_index *idx){
+    uint32_t capacity = idx->capacity ? 2 * idx->capacity : CN_INDEX_MIN_CAPACITY;
+    uint32_t old = idx->capacity, i;
+    cn_slot *slots = calloc(capacity, sizeof(cn_slot));
+    cn_slot *prev = idx->slots;
+
+    if(slots == NULL)
+        return -1;
+    idx->slots = slots;
+    idx->capacity = capacity;
+    for(i = 0; i < old; i++){
+        if(prev[i].item != NULL)
+            *cn_index_slot(idx, (const char *) prev[i].item + idx->name_offset, prev[i].hash) = prev[i];
+    }
+    free(prev);
+    return 0;
+}
+
+/*
+ * Add a record whose common name is not in the index yet
+ */
+static int
+cn_index_insert(cn_index *idx, void *item, uint32_t hash){
+    cn_slot *slot;
+    // Keep the table at most 3/4 full
+    if((idx->count + 1) * 4 > idx->capacity * 3 && cn_index_grow(idx) != 0)
+        return -1;
+    slot = cn_index_slot(idx, (const char *) item + idx->name_offset, hash);
+    slot->hash = hash;
+    slot->item = item;
+    idx->count++;
+    idx->changes++;
+    return 0;
+}
+
+/*
+ * Remove a record, the ones after it move back so that no probe sequence
+ * is broken
+ */
+static void
+cn_index_delete(cn_index *idx, void *item, uint32_t hash){
+    uint32_t mask = idx->capacity - 1;
+    uint32_t i = hash & mask, j;
+
+    while(idx->slots[i].item != item)
+        i = (i + 1) & mask;
+    idx->slots[i].item = NULL;
+    for(j = (i + 1) & mask; idx->slots[j].item != NULL; j = (j + 1) & mask){
+        // The record at j can fill the hole if the hole is between its home and j
+        if(((j - idx->slots[j].hash) & mask) >= ((j - i) & mask)){
+            idx->slots[i] = idx->slots[j];
+            idx->slots[j].item = NULL;
+            i = j;
+        }
+    }
+    idx->count--;
+    idx->changes++;
+}
+
+static uint64_t
+hold_clock(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec;
+}
+
+/*
+ * Link the hold in the wheel, at the lowest level where its expiry is in
+ * the same turn as now
+ */
+static void
+hold_schedule(hold_wheel *w, lease_hold *hold){
+    lease_hold **slot;
+    int level = 0;
+
+    while(level < HOLD_LEVELS - 1
+          && hold->expires >> (HOLD_SLOT_BITS * (level + 1)) != w->now >> (HOLD_SLOT_BITS * (level + 1)))
+        level++;
+    slot = &w->slots[level][(hold->expires >> (HOLD_SLOT_BITS * level)) & (HOLD_SLOTS - 1)];
+    hold->next = *slot;
+    if(*slot != NULL)
+        (*slot)->pprev = &hold->next;
+    hold->pprev = slot;
+    *slot = hold;
+}
+
+static void
+hold_unlink(lease_hold *hold){
+    if(hold->next != NULL)
+        hold->next->pprev = hold->pprev;
+    *hold->pprev = hold->next;
+}
+
+/*
+ * The hold is taken off the wheel and the index, and kept for the next one
+ */
+static void
+hold_remove(hold_wheel *w, lease_hold *hold){
+    hold_unlink(hold);
+    cn_index_delete(&w->index, hold, hold->hash);
+    hold->realm->nheld--;
+    hold->next = w->spare;
+    w->spare = hold;
+}
+
+/*
+ * The grace period is over: the address goes back to the realm
+ */
+static void
+hold_drop(struct plugin_context *context, lease_hold *hold){
+    realm_conf *realm = hold->realm;
+    realm_log(REALM_LOG_DEBUG, "Grace period of %s over, address %d of %s released", hold->common_name, hold->index, realm->network);
+    hold_remove(&context->holds, hold);
+    realm_release(realm, hold->index);
+    if(realm->retired && realm_idle(realm))
+        release_retired(context, realm);
+}
+
+/*
+ * Run the wheel up to now, the caller holds the context lock
+ */
+static void
+hold_expire(struct plugin_context *context){
+    hold_wheel *w = &context->holds;
+    uint64_t now = hold_clock();
+    int level;
+
+    while(w->now < now){
+        if(w->index.count == 0){
+            w->now = now;
+            break;
+        }
+        w->now++;
+        // The slots that start a new turn move down a level
+        for(level = 1; level < HOLD_LEVELS && !(w->now & ((1ULL << (HOLD_SLOT_BITS * level)) - 1)); level++){
+            lease_hold **slot = &w->slots[level][(w->now >> (HOLD_SLOT_BITS * level)) & (HOLD_SLOTS - 1)];
+            lease_hold *hold = *slot;
+            *slot = NULL;
+            while(hold != NULL){
+                lease_hold *next = hold->next;
+                hold_schedule(w, hold);
+                hold = next;
+            }
+        }
+        while(w->slots[0][w->now & (HOLD_SLOTS - 1)] != NULL)
+            hold_drop(context, w->slots[0][w->now & (HOLD_SLOTS - 1)]);
+    }
+}
+
+/*
+ * Hold the address of a client that leaves, the caller holds the context
+ * lock. Return -1 when the address has to be released now.
+ */
+static int
+hold_put(struct plugin_context *context, struct plugin_per_client_context *client){
+    hold_wheel *w = &context->holds;
+    lease_hold *hold;
+
+    if(context->grace <= 0 || client->realm->retired)
+        return -1;
+    hold_expire(context);
+    // Only the last client of a common name is held
+    hold = cn_index_find(&w->index, client->common_name, client->hash);
+    if(hold != NULL)
+        hold_drop(context, hold);
+    hold = w->spare;
+    if(hold != NULL)
+        w->spare = hold->next;
+    else if((hold = malloc(sizeof(lease_hold))) == NULL)
+        return -1;
+    hold->realm = client->realm;
+    hold->index = client->index;
+    hold->hash = client->hash;
+    hold->expires = w->now + context->grace;
+    strcpy(hold->common_name, client->common_name);
+    if(cn_index_insert(&w->index, hold, hold->hash) != 0){
+        hold->next = w->spare;
+        w->spare = hold;
+        return -1;
+    }
+    hold_schedule(w, hold);
+    client->realm->nheld++;
+    return 0;
+}
+
+/*
+ * Address held for the common name in the realm, -1 if there is none
+ */
+static int
+hold_take(struct plugin_context *context, const char *common_name, uint32_t hash, struct realm_conf *conf){
+    hold_wheel *w = &context->holds;
+    lease_hold *hold = cn_index_find(&w->index, common_name, hash);
+    int index;
+
+    if(hold == NULL)
+        return -1;
+    // The client goes to another realm now, or its address was excluded
+    if(hold->realm != conf || range_contains(conf->exclude, conf->nexclude, hold->index)){
+        hold_drop(context, hold);
+        return -1;
+    }
+    index = hold->index;
+    hold_remove(w, hold);
+    conf->reconnects++;
+    return index;
+}
+
+static void
+hold_free(hold_wheel *w){
+    lease_hold *hold;
+    uint32_t i;
+
+    for(i = 0; i < w->index.capacity; i++)
+        free(w->index.slots[i].item);
+    free(w->index.slots);
+    while((hold = w->spare) != NULL){
+        w->spare = hold->next;
+        free(hold);
+    }
+}
+
+/*
+ * Give an address of the realm to the client: the one held for it since
+ * it left, its previous one when it is still available, otherwise the
+ * first free one
+ */
+static int
+lease_ip_realm(struct plugin_context *context, const char *name, uint32_t hash, struct realm_conf *conf){
+    lease_record *rec;
+    int index = hold_take(context, name, hash, conf);
+
+    rec = index < 0 ? lease_lookup(context->leases, name) : NULL;
+    if(rec != NULL && (uint32_t)(rec->binding >> 32) == conf->network_addr){
+        uint32_t address = (uint32_t) rec->binding;
+        int prev = (int)(address - conf->first_addr);
+        if(address >= conf->first_addr && prev < conf->pool.size){
+            // The lease of a reserved address is the one of its orphan
+            if(rec->state == LEASE_ACTIVE && is_reserved(conf, prev)
+               && !range_contains(conf->exclude, conf->nexclude, prev)){
+                set_reserved(conf, prev, 0);
+                index = prev;
+            }else if(pool_take(&conf->pool, prev) == 0){
+                index = prev;
+            }
+        }
+    }
+    if(index < 0)
+        index = found_ip_realm(conf, hash);
+    if(index < 0)
+        index = reclaim_ip_realm(context, conf);
+    if(index >= 0)
+        lease_bind(context->leases, name, conf->network_addr, conf->first_addr + index);
+    return index;
+}
+
+/*
+ * Realm matcher: every realm regex is compiled in a single automaton at
+ * plugin open. The regex syntax is the one the plugin always supported:
+ * '^' and '$' anchors, '.' for any character and 'c*' for zero or more c.
+ *
+ * Each regex item is a NFA position, plus one end position per realm. The
+ * automaton is run as a DFA whose states (sets of NFA positions) are built
+ * lazily and cached, so classifying a common name is a single linear pass
+ * with one table lookup per character, whatever the number of realms.
+ */
+#define MATCHER_MAX_STATES 2048
+#define MATCHER_NO_REALM 0x7fffffff
+
+typedef struct matcher_pos{
+    int realm;
+    int c;          // character, -1 for '.'
+    int star;
+    int end;        // end position of the realm regex
+    int anchor_end; // the regex ended with '$'
+}matcher_pos;
+
+typedef struct realm_matcher{
+    arena arena;
+    int npos;
+    int nwords;
+    matcher_pos *pos;
+    int *first;        // first position of each realm
+    int *unanchored;   // realms without '^', restarted on every character
+    int nunanchored;
+    // DFA cache
+    int nstates;
+    int start;
+    uint64_t *sets;    // nwords per state
+    int *best;         // lowest realm already matched in the state
+    int *accept;       // lowest realm matched if the text ends in the state
+    char *dead;        // no character can change the result anymore
+    int *next;         // 256 transitions per state, -1 when not computed yet
+    int *hash;         // open addressing table of state ids
+    int hash_size;
+    unsigned int generation;
+    uint64_t *scratch;
+}realm_matcher;
+
+/*
+ * Add the position and the one reachable by skipping starred items
+ */
+static void
+matcher_closure(realm_matcher *m, uint64_t *set, int k){
+    for(;;){
+        set[k / 64] |= 1ULL << (k % 64);
+        if(m->pos[k].end || !m->pos[k].star)
+            return;
+        k++;
+    }
+}
+
+static uint32_t
+matcher_hash_set(realm_matcher *m, const uint64_t *set, int best){
+    uint64_t h = 1469598103934665603ULL ^ (uint64_t)best;
+    int i;
+    for(i = 0; i < m->nwords; i++){
+        h ^= set[i];
+        h *= 1099511628211ULL;
+        h ^= h >> 29;
+    }
+    return (uint32_t)h;
+}
+
+static void
+matcher_flush(realm_matcher *m){
+    m->generation++;
+    m->nstates = 0;
+    m->start = -1;
+    memset(m->hash, -1, m->hash_size * sizeof(int));
+}
+
+/*
+ * Drop the realms that can not beat the best match and compute the
+ * match state, then return the id of the DFA state for this set
+ */
+static int
+matcher_state(realm_matcher *m, uint64_t *set, int best){
+    int w, k, accept, id, empty;
+    uint32_t h;
+    uint64_t bits;
+
+    // An end position reached by a regex without '$' is a match
+    for(w = 0; w < m->nwords; w++){
+        for(bits = set[w]; bits; bits &= bits - 1){
+            k = w * 64 + __builtin_ctzll(bits);
+            if(m->pos[k].end && !m->pos[k].anchor_end && m->pos[k].realm < best)
+                best = m->pos[k].realm;
+        }
+    }
+    accept = best;
+    empty = 1;
+    for(w = 0; w < m->nwords; w++){
+        for(bits = set[w]; bits; bits &= bits - 1){
+            k = w * 64 + __builtin_ctzll(bits);
+            if(m->pos[k].realm >= best)
+                set[w] &= ~(1ULL << (k % 64));
+            else if(m->pos[k].end && m->pos[k].realm < accept)
+                accept = m->pos[k].realm;
+        }
+        if(set[w])
+            empty = 0;
+    }
+
+    h = matcher_hash_set(m, set, best) & (m->hash_size - 1);
+    while((id = m->hash[h]) >= 0){
+        if(m->best[id] == best && !memcmp(m->sets + (size_t)id * m->nwords, set, m->nwords * sizeof(uint64_t)))
+            return id;
+        h = (h + 1) & (m->hash_size - 1);
+    }
+    if(m->nstates == MATCHER_MAX_STATES){
+        // The cache is full, start again from scratch
+        matcher_flush(m);
+        h = matcher_hash_set(m, set, best) & (m->hash_size - 1);
+    }
+    id = m->nstates++;
+    memcpy(m->sets + (size_t)id * m->nwords, set, m->nwords * sizeof(uint64_t));
+    m->best[id] = best;
+    m->accept[id] = accept;
+    m->dead[id] = empty && (m->nunanchored == 0 || m->unanchored[0] >= best);
+    memset(m->next + (size_t)id * 256, -1, 256 * sizeof(int));
+    m->hash[h] = id;
+    return id;
+}
+
+static int
+matcher_start(realm_matcher *m){
+    int r;
+    memset(m->scratch, 0, m->nwords * sizeof(uint64_t));
+    for(r = 0; m->first[r] >= 0; r++)
+        matcher_closure(m, m->scratch, m->first[r]);
+    m->start = matcher_state(m, m->scratch, MATCHER_NO_REALM);
+    return m->start;
+}
+
+/*
+ * Compute the transition of the state on the character
+ */
+static int
+matcher_step(realm_matcher *m, int id, unsigned char ch){
+    const uint64_t *set = m->sets + (size_t)id * m->nwords;
+    int best = m->best[id];
+    int w, k, r;
+    uint64_t bits;
+
+    memset(m->scratch, 0, m->nwords * sizeof(uint64_t));
+    for(w = 0; w < m->nwords; w++){
+        for(bits = set[w]; bits; bits &= bits - 1){
+            k = w * 64 + __builtin_ctzll(bits);
+            if(m->pos[k].end)
+                continue;
+            if(m->pos[k].c == -1 || m->pos[k].c == ch)
+                matcher_closure(m, m->scratch, m->pos[k].star ? k : k + 1);
+        }
+    }
+    for(r = 0; r < m->nunanchored && m->unanchored[r] < best; r++)
+        matcher_closure(m, m->scratch, m->first[m->unanchored[r]]);
+    return matcher_state(m, m->scratch, best);
+}
+
+/*
+ * Return the index of the first realm whose regex match the text, -1 if none
+ */
+static int
+matcher_classify(realm_matcher *m, const char *text){
+    const unsigned char *p = (const unsigned char *) text;
+    int id = m->start >= 0 ? m->start : matcher_start(m);
+    int next;
+    unsigned int generation;
+
+    for(; *p && !m->dead[id]; p++){
+        next = m->next[(size_t)id * 256 + *p];
+        if(next < 0){
+            generation = m->generation;
+            next = matcher_step(m, id, *p);
+            // When the cache was flushed the state id is gone
+            if(generation == m->generation)
+                m->next[(size_t)id * 256 + *p] = next;
+        }
+        id = next;
+    }
+    return m->accept[id] == MATCHER_NO_REALM ? -1 : m->accept[id];
+}
+
+/*
+ * Split a realm regex in matcher positions, return the number of positions
+ * written (or needed when pos is NULL)
+ */
+static int
+matcher_parse(const char *regex, int realm, matcher_pos *pos, int *anchored){
+    const char *p = regex;
+    int n = 0, anchor_end = 0;
+
+    *anchored = 0;
+    if(*p == '^'){
+        *anchored = 1;
+        p++;
+    }
+    while(*p){
+        if(p[0] == '$' && p[1] == '\0'){
+            anchor_end = 1;
+            break;
+        }
+        if(pos){
+            pos[n].realm = realm;
+            pos[n].c = *p == '.' ? -1 : (unsigned char) *p;
+            pos[n].star = p[1] == '*';
+            pos[n].end = 0;
+        }
+        p += p[1] == '*' ? 2 : 1;
+        n++;
+    }
+    if(pos){
+        int k;
+        pos[n].realm = realm;
+        pos[n].c = 0;
+        pos[n].star = 0;
+        pos[n].end = 1;
+        for(k = 0; k <= n; k++)
+            pos[k].anchor_end = anchor_end;
+    }
+    return n + 1;
+}
+
+static void
+matcher_free(realm_matcher *m){
+    arena a;
+    if(m == NULL)
+        return;
+    a = m->arena;
+    arena_free(&a);
+}
+
+/*
+ * Compile the regex of every realm in one matcher
+ */
+static realm_matcher *
+matcher_compile(struct plugin_context *context){
+    arena a = { NULL };
+    realm_matcher *m = arena_alloc(&a, sizeof(realm_matcher));
+    int i, anchored, npos = 0;
+
+    if(m == NULL)
+        return NULL;
+    m->arena = a;
+    for(i = 0; i < context->numRealm; i++)
+        npos += matcher_parse(context->configs[i]->regex, i, NULL, &anchored);
+    m->npos = npos;
+    m->nwords = (npos + 63) / 64;
+    m->pos = arena_alloc(&m->arena, npos * sizeof(matcher_pos));
+    m->first = arena_alloc(&m->arena, (context->numRealm + 1) * sizeof(int));
+    m->unanchored = arena_alloc(&m->arena, (context->numRealm + 1) * sizeof(int));
+    m->hash_size = 2 * MATCHER_MAX_STATES;
+    m->sets = arena_alloc(&m->arena, (size_t)MATCHER_MAX_STATES * m->nwords * sizeof(uint64_t));
+    m->best = arena_alloc(&m->arena, MATCHER_MAX_STATES * sizeof(int));
+    m->accept = arena_alloc(&m->arena, MATCHER_MAX_STATES * sizeof(int));
+    m->dead = arena_alloc(&m->arena, MATCHER_MAX_STATES);
+    m->next = arena_alloc(&m->arena, (size_t)MATCHER_MAX_STATES * 256 * sizeof(int));
+    m->hash = arena_alloc(&m->arena, m->hash_size * sizeof(int));
+    m->scratch = arena_alloc(&m->arena, m->nwords * sizeof(uint64_t));
+    if(!m->pos || !m->first || !m->unanchored || !m->sets || !m->best || !m->accept
+       || !m->dead || !m->next || !m->hash || !m->scratch){
+        matcher_free(m);
+        return NULL;
+    }
+
+    npos = 0;
+    for(i = 0; i < context->numRealm; i++){
+        m->first[i] = npos;
+        npos += matcher_parse(context->configs[i]->regex, i, m->pos + npos, &anchored);
+        if(!anchored)
+            m->unanchored[m->nunanchored++] = i;
+    }
+    m->first[context->numRealm] = -1;
+    matcher_flush(m);
+    return m;
+}
+
+static uint64_t
+latency_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+latency_bucket(uint64_t ns){
+    int shift;
+    if(ns < 2 * LATENCY_SUB)
+        return (int) ns;
+    shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+    if(shift > LATENCY_MAX_SHIFT)
+        return LATENCY_BUCKETS - 1;
+    return (shift + 1) * LATENCY_SUB + (int) (ns >> shift) - LATENCY_SUB;
+}
+
+/*
+ * Highest value counted in a bucket
+ */
+static uint64_t
+latency_bucket_max(int bucket){
+    int shift;
+    if(bucket < 2 * LATENCY_SUB)
+        return bucket;
+    shift = bucket / LATENCY_SUB - 1;
+    return ((uint64_t) (bucket % LATENCY_SUB + LATENCY_SUB + 1) << shift) - 1;
+}
+
+static void
+latency_record(latency_histogram *h, uint64_t start){
+    uint64_t ns = latency_now() - start;
+    __atomic_fetch_add(&h->buckets[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * Learned addresses: openvpn tells which virtual address it routes to
+ * which client. An address of a realm is checked against the pool: a
+ * routed address the plugin gave to another client is a conflict, one
+ * that is still free (an address pushed by hand) is taken out of the pool
+ * while it is routed so that nobody else gets it.
+ */
+static uint32_t
+learn_hash(uint32_t address){
+    address ^= address >> 16;
+    address *= 0x85ebca6bu;
+    address ^= address >> 13;
+    address *= 0xc2b2ae35u;
+    return address ^ (address >> 16);
+}
+
+static addr_slot *
+learn_slot(addr_index *idx, uint32_t address){
+    uint32_t mask = idx->capacity - 1;
+    uint32_t i = learn_hash(address) & mask;
+    while(idx->slots[i].item != NULL && idx->slots[i].address != address)
+        i = (i + 1) & mask;
+    return &idx->slots[i];
+}
+
+static learned_addr *
+learn_find(addr_index *idx, uint32_t address){
+    if(idx->count == 0)
+        return NULL;
+    return learn_slot(idx, address)->item;
+}
+
+static int
+learn_grow(addr_index *idx){
+    uint32_t capacity = idx->capacity ? 2 * idx->capacity : CN_INDEX_MIN_CAPACITY;
+    uint32_t old = idx->capacity, i;
+    addr_slot *slots = calloc(capacity, sizeof(addr_slot));
+    addr_slot *prev = idx->slots;
+
+    if(slots == NULL)
+        return -1;
+    idx->slots = slots;
+    idx->capacity = capacity;
+    for(i = 0; i < old; i++){
+        if(prev[i].item != NULL)
+            *learn_slot(idx, prev[i].address) = prev[i];
+    }
+    free(prev);
+    return 0;
+}
+
+static void
+learn_delete(addr_index *idx, uint32_t address){
+    uint32_t mask = idx->capacity - 1;
+    uint32_t i = learn_hash(address) & mask, j;
+
+    while(idx->slots[i].address != address || idx->slots[i].item == NULL)
+        i = (i + 1) & mask;
+    idx->slots[i].item = NULL;
+    for(j = (i + 1) & mask; idx->slots[j].item != NULL; j = (j + 1) & mask){
+        if(((j - learn_hash(idx->slots[j].address)) & mask) >= ((j - i) & mask)){
+            idx->slots[i] = idx->slots[j];
+            idx->slots[j].item = NULL;
+            i = j;
+        }
+    }
+    idx->count--;
+}
+
+/*
+ * openvpn does not route the address anymore
+ */
+static void
+learn_remove(struct plugin_context *context, learned_addr *learned){
+    realm_conf *realm = learned->realm;
+    learn_delete(&context->learned, learned->address);
+    if(learned->next != NULL)
+        learned->next->pprev = learned->pprev;
+    *learned->pprev = learned->next;
+    learned->next = context->learned.spare;
+    context->learned.spare = learned;
+    if(realm != NULL){
+        realm_release(realm, learned->index);
+        if(realm->retired && realm_idle(realm))
+            release_retired(context, realm);
+    }
+}
+
+/*
+ * Check the address against the realm it belongs to, the caller holds the
+ * context lock
+ */
+static void
+learn_check(struct plugin_context *context, learned_addr *learned){
+    struct plugin_per_client_context *client = learned->client;
+    realm_conf *realm = realm_of_address(context, learned->address);
+    char address[ADDRESS_TEXT_SIZE];
+    int index;
+
+    if(realm == NULL || learned->address < realm->first_addr)
+        return;
+    index = (int) (learned->address - realm->first_addr);
+    if(index >= realm->pool.size || is_excluded(realm, index))
+        return;
+    if(client->realm == realm && client->index == index)
+        return;
+    format_address(learned->address, address);
+    if(pool_take(&realm->pool, index) == 0){
+        learned->realm = realm;
+        learned->index = index;
+        realm_log(REALM_LOG_WARN, "%s is routed to %s but was not given by the plugin, it is kept out of %s/%d",
+                  address, client->common_name, realm->network, realm->prefix);
+    }else{
+        // Only an address already given to somebody else is a conflict
+        realm->conflicts++;
+        realm_log(REALM_LOG_WARN, "Address conflict: %s is routed to %s but the plugin gave it to another client",
+                  address, client->common_name);
+    }
+}
+
+/*
+ * OPENVPN_PLUGIN_LEARN_ADDRESS: argv[1] is add, update or delete and
+ * argv[2] the address. Only IPv4 host addresses are followed, and the
+ * route is never refused.
+ */
+static int
+client_learn(struct plugin_context *context, const char *argv[], struct plugin_per_client_context *client){
+    learned_addr *learned;
+    uint32_t address;
+
+    if(argv[1] == NULL || argv[2] == NULL || conf_parse_ipv4(argv[2], &address) != 0)
+        return OPENVPN_PLUGIN_FUNC_SUCCESS;
+    pthread_mutex_lock(&context->lock);
+    learned = learn_find(&context->learned, address);
+    if(!strcmp(argv[1], "delete")){
+        if(learned != NULL)
+            learn_remove(context, learned);
+    }else if(client != NULL && (learned == NULL || learned->client != client)){
+        if(learned != NULL){
+            // A new session of the same common name is not a conflict
+            if(strcmp(learned->client->common_name, client->common_name))
+                realm_log(REALM_LOG_WARN, "Address conflict: %s is now routed to %s instead of %s",
+                          argv[2], client->common_name, learned->client->common_name);
+            learn_remove(context, learned);
+        }
+        if((context->learned.count + 1) * 4 <= context->learned.capacity * 3 || learn_grow(&context->learned) == 0){
+            learned = context->learned.spare;
+            if(learned != NULL)
+                context->learned.spare = learned->next;
+            else
+                learned = malloc(sizeof(learned_addr));
+        }else{
+            learned = NULL;
+        }
+        if(learned != NULL){
+            addr_slot *slot = learn_slot(&context->learned, address);
+            learned->client = client;
+            learned->realm = NULL;
+            learned->address = address;
+            slot->address = address;
+            slot->item = learned;
+            context->learned.count++;
+            learned->next = client->learned;
+            if(learned->next != NULL)
+                learned->next->pprev = &learned->next;
+            learned->pprev = &client->learned;
+            client->learned = learned;
+            learn_check(context, learned);
+        }
+    }
+    pthread_mutex_unlock(&context->lock);
+    return OPENVPN_PLUGIN_FUNC_SUCCESS;
+}
+
+/*
+ * The client is gone, its routes with it
+ */
+static void
+learn_forget(struct plugin_context *context, struct plugin_per_client_context *client){
+    while(client->learned != NULL)
+        learn_remove(context, client->learned);
+}
+
+static void
+learn_free(addr_index *idx){
+    learned_addr *learned;
+    uint32_t i;
+
+    for(i = 0; i < idx->capacity; i++)
+        free(idx->slots[i].item);
+    free(idx->slots);
+    while((learned = idx->spare) != NULL){
+        idx->spare = learned->next;
+        free(learned);
+    }
+}
+
+/*
+ * Look up the realm of the common name and take an address in it, the
+ * caller holds the context lock. A common name has a single address: a
+ * client that connects again, or a new session of a common name that is
+ * still connected, gets the address it already has.
+ */
+static int
+client_allocate (struct plugin_context *context, const char *common_name, struct plugin_per_client_context *client_ip){
+    struct plugin_per_client_context *owner;
+    uint32_t hash = lease_hash(common_name);
+    int i, index;
+
+    if(client_ip->realm != NULL && strcmp(client_ip->common_name, common_name))
+        client_release(context, client_ip);
+    // Look for the first realm whose regex correspond to the common_name of the certificate
+    i = matcher_classify(context->matcher, common_name);
+    owner = cn_index_find(&context->clients, common_name, hash);
+    if(i < 0){
+        realm_log(REALM_LOG_DEBUG, "No match founded for %s",common_name);
+        context->unmatched++;
+        if(owner == client_ip)
+            client_release(context, client_ip);
+        return -1;
+    }
+    realm_log(REALM_LOG_DEBUG, "Match founded for %s in Realm Number %d with regex %s",common_name,i, context->configs[i]->regex);
+    if(owner != NULL && owner->realm == context->configs[i]){
+        if(owner != client_ip){
+            realm_log(REALM_LOG_DEBUG, "%s connected again, address %d of %s moves to the new session", common_name, owner->index, owner->realm->network);
+            client_ip->realm = owner->realm;
+            client_ip->index = owner->index;
+            client_ip->hash = hash;
+            strcpy(client_ip->common_name, common_name);
+            cn_index_slot(&context->clients, common_name, hash)->item = client_ip;
+            // The disconnect of the previous session has nothing to release
+            owner->realm = NULL;
+        }
+        client_ip->realm->connects++;
+        return client_ip->index;
+    }
+    // The common name moved to another realm with a reload
+    if(owner != NULL)
+        client_release(context, owner);
+    if(context->grace > 0)
+        hold_expire(context);
+    index = lease_ip_realm(context, common_name, hash, context->configs[i]);
+    if(index >= 0){
+        // Edit the client context
+        client_ip->realm = context->configs[i];
+        client_ip->index = index;
+        client_ip->hash = hash;
+        strcpy(client_ip->common_name, common_name);
+        if(cn_index_insert(&context->clients, client_ip, hash) != 0){
+            client_ip->realm = NULL;
+            lease_release(context->leases, common_name, context->configs[i]->network_addr, context->configs[i]->first_addr + index);
+            realm_release(context->configs[i], index);
+            index = -1;
+        }
+    }
+    if(index >= 0)
+        context->configs[i]->connects++;
+    else
+        context->configs[i]->alloc_failures++;
+    return index;
+}
+
+/*
+ * Configuration of the client from the template of its realm, in conf of
+ * PUSH_CONF_SIZE bytes, the caller holds the context lock
+ */
+static void
+client_push_config(const struct plugin_per_client_context *client_ip, char *conf){
+    const push_template *t = client_ip->realm->conf;
+    const char *text = t->text;
+    char address[ADDRESS_TEXT_SIZE];
+    size_t address_len = strlen(format_address(client_ip->realm->first_addr + client_ip->index, address));
+    int i;
+
+    for(i = 0; ; i++){
+        memcpy(conf, text, t->len[i]);
+        conf += t->len[i];
+        text += t->len[i];
+        if(i == t->npieces - 1)
+            break;
+        memcpy(conf, address, address_len);
+        conf += address_len;
+    }
+    *conf = '\0';
+}
+
+/*
+ * Give the address of the client back, the caller holds the context lock
+ */
+static void
+client_release (struct plugin_context *context, struct plugin_per_client_context *client_conf){
+    learned_addr *learned;
+
+    if(client_conf->realm == NULL)
+        return;
+    // Delete the file concerning the configuration, also for a client
+    // that never connected after TLS_FINAL
+    if(client_conf->conf_written){
+        conf_dir_remove(context, client_conf->common_name);
+        client_conf->conf_written = 0;
+    }
+    cn_index_delete(&context->clients, client_conf, client_conf->hash);
+    // relase the ip in the global conf
+    lease_release(context->leases, client_conf->common_name,
+                  client_conf->realm->network_addr, client_conf->realm->first_addr + client_conf->index);
+    client_conf->realm->disconnects++;
+    learned = learn_find(&context->learned, client_conf->realm->first_addr + client_conf->index);
+    if(learned != NULL && learned->client != client_conf && learned->realm == NULL){
+        // Still routed to another client, kept out of the pool for it
+        learned->realm = client_conf->realm;
+        learned->index = client_conf->index;
+    }else if(hold_put(context, client_conf) != 0){
+        // Not held for a grace period, released now
+        realm_release(client_conf->realm, client_conf->index);
+        if(client_conf->realm->retired && realm_idle(client_conf->realm))
+            release_retired(context, client_conf->realm);
+    }
+    client_conf->realm = NULL;
+}
+
+/*
+ * Write data in filename, without stdio so nothing is allocated
+ */
+static int
+write_file(const char *filename, const char *data){
+    size_t len = strlen(data);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int ok;
+    if(fd < 0)
+        return -1;
+    ok = write(fd, data, len) == (ssize_t) len;
+    return close(fd) == 0 && ok ? 0 : -1;
+}
+
+/*
+ * Packet filter, with OPENVPN_PLUGIN_ENABLE_PF: openvpn gives each client a
+ * pf_file and blocks its traffic until the file is written. The file of a
+ * realm is rendered once when the configuration is loaded, a client only
+ * gets a copy of it, written under a temporary name and renamed so openvpn
+ * never reads half of it. The clients of a realm without pf section get
+ * everything accepted. The realm text can go with a reload once the client
+ * is gone, so it is copied under the lock and written after it.
+ */
+#define PF_CLIENTS 1
+#define PF_SUBNETS 2
+#define PF_END 4
+#define PF_CONF_SIZE 16384
+
+static const char pf_accept_all[] = "[CLIENTS ACCEPT]\n[SUBNETS ACCEPT]\n[END]\n";
+
+/*
+ * Copy the rules of the client in pf, PF_CONF_SIZE bytes, the caller holds
+ * the context lock
+ */
+static size_t
+client_copy_pf(const struct plugin_per_client_context *client, char *pf){
+    const char *text = client->realm->pf != NULL ? client->realm->pf : pf_accept_all;
+    size_t len = client->realm->pf != NULL ? client->realm->pf_len : sizeof(pf_accept_all) - 1;
+
+    memcpy(pf, text, len);
+    return len;
+}
+
+static int
+write_pf(const char *pf_file, const char *pf, size_t len){
+    char tmp[PATH_MAX];
+    int fd, ok;
+
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", pf_file) >= (int) sizeof(tmp))
+        return -1;
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(fd < 0)
+        return -1;
+    ok = write(fd, pf, len) == (ssize_t) len;
+    if(close(fd) != 0 || !ok || rename(tmp, pf_file) != 0){
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * OPENVPN_PLUGIN_ENABLE_PF, comes with the pf_file of the client. The file
+ * is written here if the client already has its realm, from TLS_FINAL,
+ * otherwise on connect.
+ */
+static int
+client_enable_pf(struct plugin_context *context, const char *envp[], struct plugin_per_client_context *client){
+    const char *pf_file = get_env("pf_file", envp);
+    char pf[PF_CONF_SIZE];
+    size_t len = 0;
+
+    if(!context->pf || client == NULL)
+        return OPENVPN_PLUGIN_FUNC_ERROR;
+    if(pf_file == NULL)
+        return OPENVPN_PLUGIN_FUNC_SUCCESS;
+    pthread_mutex_lock(&context->lock);
+    if(client->realm != NULL)
+        len = client_copy_pf(client, pf);
+    pthread_mutex_unlock(&context->lock);
+    if(len > 0 && write_pf(pf_file, pf, len) != 0){
+        realm_log(REALM_LOG_ERROR, "Could not write the packet filter in %s", pf_file);
+        return OPENVPN_PLUGIN_FUNC_ERROR;
+    }
+    return OPENVPN_PLUGIN_FUNC_SUCCESS;
+}
+
+/*
+ * Client-config-dir files: the folder is opened at plugin open, unless
+ * the connections are deferred and nothing is written in it, and each
+ * file is a name relative to it, so no path is built. A common name is a
+ * single file name: it cannot be empty, hold a slash or start with a dot,
+ * which is kept for the temporary files.
+ */
+static int
+conf_dir_open(struct plugin_context *context){
+    if(context->conf_dir == NULL)
+        return 0;
+    context->conf_dirfd = open(context->conf_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(context->conf_dirfd < 0){
+        realm_log(REALM_LOG_ERROR, "Could not open the configuration folder %s: %s", context->conf_dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int
+conf_dir_name_ok(const char *common_name){
+    return common_name[0] != '\0' && common_name[0] != '.' && strchr(common_name, '/') == NULL;
+}
+
+/*
+ * Write the file of the client in a temporary file renamed over it, so
+ * openvpn reads either the previous file or the whole new one
+ */
+static int
+conf_dir_write(struct plugin_context *context, const char *common_name, const char *conf){
+    char tmp[COMMON_NAME_SIZE + sizeof("..tmp")];
+    size_t len = strlen(conf);
+    int fd, ok;
+
+    if(!conf_dir_name_ok(common_name))
+        return -1;
+    sprintf(tmp, ".%s.tmp", common_name);
+    fd = openat(context->conf_dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0666);
+    if(fd < 0)
+        return -1;
+    ok = write(fd, conf, len) == (ssize_t) len;
+    if(close(fd) != 0 || !ok || renameat(context->conf_dirfd, tmp, context->conf_dirfd, common_name) != 0){
+        unlinkat(context->conf_dirfd, tmp, 0);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+conf_dir_remove(struct plugin_context *context, const char *common_name){
+    if(conf_dir_name_ok(common_name))
+        unlinkat(context->conf_dirfd, common_name, 0);
+}
+
+/*
+ * Need to lookup for the IP, then hand the configuration to openvpn: either
+ * as a file in the client-config-dir or, when no directory was given, in
+ * the return_list of OPENVPN_PLUGIN_CLIENT_CONNECT_V2
+ */
+static int
+client_connect (struct plugin_context *context, const char *argv[], const char *envp[], struct plugin_per_client_context *client_ip, struct openvpn_plugin_string_list **return_list){
+    static const char *const names[] = { "common_name", "pf_file" };
+    const char *values[2], *common_name;
+    char conf[PUSH_CONF_SIZE], pf[PF_CONF_SIZE];
+    size_t pf_len = 0;
+    int index;
+
+    get_env_list(names, values, context->pf ? 2 : 1, envp);
+    common_name = values[0];
+    if(common_name == NULL || strlen(common_name) >= COMMON_NAME_SIZE)
+        return OPENVPN_PLUGIN_FUNC_ERROR;
+    realm_log(REALM_LOG_DEBUG, "common_name %s",common_name);
+    pthread_mutex_lock(&context->lock);
+    index = client_allocate(context, common_name, client_ip);
+    // Configuration
+    if(index >= 0){
+        client_push_config(client_ip, conf);
+        if(context->pf && values[1] != NULL)
+            pf_len = client_copy_pf(client_ip, pf);
+    }
+    pthread_mutex_unlock(&context->lock);
+    if(pf_len > 0 && write_pf(values[1], pf, pf_len) != 0)
+        realm_log(REALM_LOG_ERROR, "Could not write the packet filter of %s in %s", common_name, values[1]);
+    // If we found an ip address
+    if(index < 0){
+        if(context->conf_dirfd >= 0)
+            conf_dir_remove(context, common_name);
+        return OPENVPN_PLUGIN_FUNC_ERROR;
+    }
+    if(context->conf_dirfd >= 0){
+        if(conf_dir_write(context, common_name, conf) != 0){
+            realm_log(REALM_LOG_ERROR, "Could not write the configuration of %s in %s", common_name, context->conf_dir);
+            client_disconnect(context, argv, envp, client_ip);
+            return OPENVPN_PLUGIN_FUNC_ERROR;
+        }
+        client_ip->conf_written = 1;
+        realm_log(REALM_LOG_DEBUG, "Configuration file generated for %s: %s",common_name,conf);
+    }else if(return_list != NULL){
+        // Give back the configuration to openvpn, it frees the list and its
+        // strings: the only allocations of the connection
+        struct openvpn_plugin_string_list *rl = malloc(sizeof(struct openvpn_plugin_string_list));
+        if(rl == NULL || (rl->name = strdup("config")) == NULL || (rl->value = strdup(conf)) == NULL){
+            if(rl != NULL)
+                free(rl->name);
+            free(rl);
+            client_disconnect(context, argv, envp, client_ip);
+            return OPENVPN_PLUGIN_FUNC_ERROR;
+        }
+        rl->next = NULL;
+        *return_list = rl;
+        realm_log(REALM_LOG_DEBUG, "Configuration returned for %s: %s",common_name,conf);
+    }
+    return OPENVPN_PLUGIN_FUNC_SUCCESS;
+}
+
+/*
+ * OPENVPN_PLUGIN_TLS_VERIFY, with tls-verify=1: argv[1] is the depth of
+ * the certificate. At depth 0 (the client certificate) the handshake is
+ * stopped right away when the common name matches no realm, or when its
+ * realm is full and nothing is kept for it, instead of after the whole
+ * key exchange.
+ */
+static int
+client_tls_verify (struct plugin_context *context, const char *argv[], const char *envp[]){
+    const char *common_name = get_env("X509_0_CN", envp);
+    struct plugin_per_client_context *owner;
+    lease_hold *hold;
+    realm_conf *realm;
+    uint32_t hash;
+    int i, ret = OPENVPN_PLUGIN_FUNC_SUCCESS;
+
+    if(argv[1] == NULL || strcmp(argv[1], "0"))
+        return OPENVPN_PLUGIN_FUNC_SUCCESS;
+    if(common_name == NULL || strlen(common_name) >= COMMON_NAME_SIZE)
+        return OPENVPN_PLUGIN_FUNC_ERROR;
+    hash = lease_hash(common_name);
+    pthread_mutex_lock(&context->lock);
+    i = matcher_classify(context->matcher, common_name);
+    if(i < 0){
+        realm_log(REALM_LOG_DEBUG, "No match founded for %s, refused at TLS verify", common_name);
+        context->unmatched++;
+        ret = OPENVPN_PLUGIN_FUNC_ERROR;
+    }else if(pool_free_count(&(realm = context->configs[i])->pool) == 0 && realm->norphans == 0){
+        // Still fine if it has an address or one is held for it
+        owner = cn_index_find(&context->clients, common_name, hash);
+        hold = cn_index_find(&context->holds.index, common_name, hash);
+        if((owner == NULL || owner->realm != realm) && (hold == NULL || hold->realm != realm)){
+            realm_log(REALM_LOG_DEBUG, "Realm %s is full, %s refused at TLS verify", realm->network, common_name);
+            realm->alloc_failures++;
+            ret = OPENVPN_PLUGIN_FUNC_ERROR;
+        }
+    }
+    pthread_mutex_unlock(&context->lock);
+    return ret;
+}
+
+/*
+ * OPENVPN_PLUGIN_IPCHANGE: the real address of the client is known, at the
+ * connection and again each time the client floats. The address of the
+ * client does not change, only its metadata is updated.
+ */
+static int
+client_ipchange (struct plugin_context *context, const char *envp[], struct plugin_per_client_context *client_conf){
+    static const char *const names[] = { "trusted_ip", "trusted_port", "trusted_ip6" };
+    const char *values[3], *remote, *port;
+    int remote_port;
+
+    get_env_list(names, values, 3, envp);
+    remote = values[0] != NULL ? values[0] : values[2];
+    port = values[1];
+    if(client_conf == NULL || remote == NULL || strlen(remote) >= sizeof(client_conf->remote))
+        return OPENVPN_PLUGIN_FUNC_SUCCESS;
+    remote_port = port != NULL ? atoi(port) : 0;
+    pthread_mutex_lock(&context->lock);
+    if(client_conf->remote[0] != '\0' && (strcmp(client_conf->remote, remote) || client_conf->remote_port != remote_port)){
+        realm_log(REALM_LOG_DEBUG, "%s floated from %s:%d to %s:%d", client_conf->common_name,
+                  client_conf->remote, client_conf->remote_port, remote, remote_port);
+        if(client_conf->realm != NULL)
+            client_conf->realm->floats++;
+    }
+    strcpy(client_conf->remote, remote);
+    client_conf->remote_port = remote_port;
+    pthread_mutex_unlock(&context->lock);
+    return OPENVPN_PLUGIN_FUNC_SUCCESS;
+}
+
+/*
+ * On client disconnection we need to clean the file
+ */
+static int
+client_disconnect (struct plugin_context *context, const char *argv[], const char *envp[], struct plugin_per_client_context *client_conf){
+      pthread_mutex_lock(&context->lock);
+      if(client_conf->realm != NULL){
+          realm_log(REALM_LOG_DEBUG, "Disconnect: address %d of %s", client_conf->index, client_conf->realm->network);
+          client_release(context, client_conf);
+      }
+      pthread_mutex_unlock(&context->lock);
+      return OPENVPN_PLUGIN_FUNC_SUCCESS;
+}
+
+/*
+ * Deferred client connect (openvpn 2.5 and later): the callback only
+ * queues the connection and returns OPENVPN_PLUGIN_FUNC_DEFERRED, the
+ * worker thread takes the address, writes the configuration in the file
+ * given by openvpn and then reports the result in the deferred file.
+ */
+typedef struct connect_job{
+    struct connect_job *next;
+    struct plugin_per_client_context *client;   // NULL once the client is gone
+    char common_name[LEASE_CN_SIZE];
+    char config_file[PATH_MAX];
+    char deferred_file[PATH_MAX];
+    char pf_file[PATH_MAX];
+    uint64_t queued;
+}connect_job;
+
+static void
+run_connect_job(struct plugin_context *context, connect_job *job){
+    char conf[PUSH_CONF_SIZE], pf[PF_CONF_SIZE];
+    size_t pf_len = 0;
+    int ok = 0;
+
+    pthread_mutex_lock(&context->lock);
+    if(job->client != NULL){
+        job->client->job = NULL;
+        if(client_allocate(context, job->common_name, job->client) >= 0){
+            client_push_config(job->client, conf);
+            ok = 1;
+            if(job->pf_file[0] != '\0')
+                pf_len = client_copy_pf(job->client, pf);
+        }
+    }
+    pthread_mutex_unlock(&context->lock);
+
+    if(pf_len > 0 && write_pf(job->pf_file, pf, pf_len) != 0)
+        realm_log(REALM_LOG_ERROR, "Could not write the packet filter of %s in %s", job->common_name, job->pf_file);
+
+    if(ok && write_file(job->config_file, conf) != 0){
+        realm_log(REALM_LOG_ERROR, "Could not write the configuration of %s in %s", job->common_name, job->config_file);
+        ok = 0;
+    }
+    if(ok)
+        realm_log(REALM_LOG_DEBUG, "Configuration generated for %s: %s", job->common_name, conf);
+    // openvpn disconnects the client on failure, the address is released then
+    if(write_file(job->deferred_file, ok ? "1" : "0") != 0)
+        realm_log(REALM_LOG_ERROR, "Could not write the deferred status of %s in %s", job->common_name, job->deferred_file);
+    // Time seen by the client, waiting in the queue included
+    latency_record(&context->latency, job->queued);
+}
+
+static void *
+connect_thread(void *arg){
+    struct plugin_context *context = (struct plugin_context *) arg;
+    connect_job *job;
+
+    pthread_mutex_lock(&context->queue_lock);
+    for(;;){
+        while(context->queue_head == NULL && !context->queue_stop)
+            pthread_cond_wait(&context->queue_cond, &context->queue_lock);
+        if(context->queue_head == NULL)
+            break;
+        job = context->queue_head;
+        context->queue_head = job->next;
+        if(context->queue_head == NULL)
+            context->queue_tail = NULL;
+        pthread_mutex_unlock(&context->queue_lock);
+        run_connect_job(context, job);
+        pthread_mutex_lock(&context->queue_lock);
+        job->next = context->queue_spare;
+        context->queue_spare = job;
+    }
+    pthread_mutex_unlock(&context->queue_lock);
+    return NULL;
+}
+
+static int
+start_connect_thread(struct plugin_context *context){
+    pthread_mutex_init(&context->queue_lock, NULL);
+    pthread_cond_init(&context->queue_cond, NULL);
+    if(pthread_create(&context->queue_thread, NULL, connect_thread, context) != 0)
+        return -1;
+    context->queue_running = 1;
+    return 0;
+}
+
+/*
+ * Finish the queued connections and stop the worker
+ */
+static void
+stop_connect_thread(struct plugin_context *context){
+    if(!context->queue_running)
+        return;
+    pthread_mutex_lock(&context->queue_lock);
+    context->queue_stop = 1;
+    pthread_cond_signal(&context->queue_cond);
+    pthread_mutex_unlock(&context->queue_lock);
+    pthread_join(context->queue_thread, NULL);
+    context->queue_running = 0;
+    while(context->queue_spare != NULL){
+        connect_job *job = context->queue_spare;
+        context->queue_spare = job->next;
+        free(job);
+    }
+}
+
+/*
+ * A job for a new connection, from the spare ones when there is one
+ */
+static connect_job *
+connect_job_get(struct plugin_context *context){
+    connect_job *job;
+    pthread_mutex_lock(&context->queue_lock);
+    job = context->queue_spare;
+    if(job != NULL)
+        context->queue_spare = job->next;
+    pthread_mutex_unlock(&context->queue_lock);
+    if(job == NULL)
+        return malloc(sizeof(connect_job));
+    return job;
+}
+
+static void
+connect_job_put(struct plugin_context *context, connect_job *job){
+    pthread_mutex_lock(&context->queue_lock);
+    job->next = context->queue_spare;
+    context->queue_spare = job;
+    pthread_mutex_unlock(&context->queue_lock);
+}
+
+/*
+ * OPENVPN_PLUGIN_CLIENT_CONNECT in async mode
+ */
+static int
+client_connect_deferred (struct plugin_context *context, const char *argv[], const char *envp[], struct plugin_per_client_context *client_ip){
+    static const char *const names[] = { "common_name", "client_connect_deferred_file", "client_connect_config_file", "pf_file" };
+    const char *values[4], *common_name, *deferred_file, *config_file;
+    connect_job *job;
+
+    get_env_list(names, values, context->pf ? 4 : 3, envp);
+    common_name = values[0];
+    deferred_file = values[1];
+    config_file = values[2];
+    if(config_file == NULL && argv[1] != NULL)
+        config_file = argv[1];
+    if(common_name == NULL || config_file == NULL || strlen(common_name) >= sizeof(job->common_name))
+        return OPENVPN_PLUGIN_FUNC_ERROR;
+    job = connect_job_get(context);
+    if(job == NULL)
+        return OPENVPN_PLUGIN_FUNC_ERROR;
+    job->next = NULL;
+    job->client = NULL;
+    job->pf_file[0] = '\0';
+    if(context->pf && values[3] != NULL && strlen(values[3]) < sizeof(job->pf_file))
+        strcpy(job->pf_file, values[3]);
+    strcpy(job->common_name, common_name);
+    snprintf(job->config_file, sizeof(job->config_file), "%s", config_file);
+    // An openvpn without deferred client connect: do it now
+    if(deferred_file == NULL || strlen(deferred_file) >= sizeof(job->deferred_file)){
+        char conf[PUSH_CONF_SIZE], pf[PF_CONF_SIZE];
+        size_t pf_len = 0;
+        int ok;
+        pthread_mutex_lock(&context->lock);
+        ok = client_allocate(context, job->common_name, client_ip) >= 0;
+        if(ok){
+            client_push_config(client_ip, conf);
+            if(job->pf_file[0] != '\0')
+                pf_len = client_copy_pf(client_ip, pf);
+        }
+        pthread_mutex_unlock(&context->lock);
+        if(pf_len > 0 && write_pf(job->pf_file, pf, pf_len) != 0)
+            realm_log(REALM_LOG_ERROR, "Could not write the packet filter of %s in %s", job->common_name, job->pf_file);
+        if(ok && write_file(job->config_file, conf) != 0)
+            ok = 0;
+        connect_job_put(context, job);
+        return ok ? OPENVPN_PLUGIN_FUNC_SUCCESS : OPENVPN_PLUGIN_FUNC_ERROR;
+    }
+    strcpy(job->deferred_file, deferred_file);
+    job->queued = latency_now();
+
+    pthread_mutex_lock(&context->lock);
+    // A connection still queued for the client is superseded
+    if(client_ip->job != NULL)
+        client_ip->job->client = NULL;
+    job->client = client_ip;
+    client_ip->job = job;
+    pthread_mutex_unlock(&context->lock);
+
+    pthread_mutex_lock(&context->queue_lock);
+    if(context->queue_tail != NULL)
+        context->queue_tail->next = job;
+    else
+        context->queue_head = job;
+    context->queue_tail = job;
+    pthread_cond_signal(&context->queue_cond);
+    pthread_mutex_unlock(&context->queue_lock);
+    return OPENVPN_PLUGIN_FUNC_DEFERRED;
+}
+
+/*
+ * Generate the pool of each realm: an address is only a bit in the pool
+ * and its text is written when a client gets it
+ */
+static int 
+generate_subnet(struct plugin_context *context, const char *argv[], const char *envp[])
+{
+    int i, count;
+
+    for(i = 0; i < context->numRealm; i++){
+        realm_conf *realm = context->configs[i];
+        // Do not give the network, gateway and broadcast addresses, nor the
+        // DHCP one below the broadcast when the realm is large enough
+        count = (int) ((1ULL << (32 - realm->prefix)) - (realm->prefix <= 29 ? 4 : 3));
+        realm_log(REALM_LOG_DEBUG, "NUM SUBNET %d",count);
+        if(context->shm != NULL){
+            char name[NAME_MAX + 1], address[ADDRESS_TEXT_SIZE];
+            if(snprintf(name, sizeof(name), "%s-%s-%d", context->shm, format_address(realm->network_addr, address), realm->prefix) >= (int) sizeof(name)
+               || pool_attach(&realm->pool, count, name, context->shm_id) != 0)
+                return -1;
+        }else if(pool_init(&realm->pool, count, &realm->arena) != 0){
+            return -1;
+        }
+        realm->reserved = arena_alloc(&realm->arena, (realm->pool.nwords ? realm->pool.nwords : 1) * sizeof(uint64_t));
+        realm->excluded = arena_alloc(&realm->arena, (realm->pool.nwords ? realm->pool.nwords : 1) * sizeof(uint64_t));
+        if(realm->reserved == NULL || realm->excluded == NULL)
+            return -1;
+        realm->first_addr = realm->network_addr + 2;
+        exclude_normalize(realm);
+        // A shared pool is only changed once the realm is in use
+        if(realm->pool.shared == NULL)
+            exclude_apply(realm);
+    }
+    return 0;
+}
+
+/*
+ * A realm with a shared pool is put in use: its exclusions are applied to
+ * the pool only now, so a refused reload or a realm that is carried over
+ * leaves the pool alone. On start the addresses the previous run of this
+ * instance left in the pool are taken back first, its leases reserve again
+ * those of its clients.
+ */
+static void
+share_realm(realm_conf *realm, int start){
+    if(realm->pool.shared == NULL)
+        return;
+    if(start){
+        int reclaimed = pool_reclaim(&realm->pool);
+        if(reclaimed > 0)
+            realm_log(REALM_LOG_INFO, "%d addresses of %s taken back from the previous run", reclaimed, realm->network);
+    }
+    exclude_apply(realm);
+}
+
+/*
+ * Configuration parser: one realm per line, in one pass over the file
+ *
+ *   network#regex#netmask#       10.0.2.0#^CA*#255.255.255.0#
+ *   network/prefix#regex#        10.0.2.0/24#^CA*#
+ *
+ * followed by name=value options:
+ *
+ *   exclude=LIST   addresses kept out of the pool, LIST is made of
+ *                  addresses, a.b.c.d/n networks and a.b.c.d-e.f.g.h
+ *                  ranges separated by commas
+ *   policy=NAME    how a new client gets its address: first (the first
+ *                  free one, the default) or hash (derived from the
+ *                  common name, the same on every server)
+ *
+ * A realm line can be followed by push "option" lines, given to its clients
+ * after their ifconfig-push, where %address% stands for the address of the
+ * client and %netmask% for the netmask of the realm.
+ *
+ * It can also be followed by its packet filter, in the pf file
+ * grammar of openvpn: a [CLIENTS ACCEPT|DROP] section then a
+ * [SUBNETS ACCEPT|DROP] one, with +name/-name and +a.b.c.d[/n]/-a.b.c.d[/n]
+ * entries, and an optional [END]. A missing section accepts everything.
+ *
+ * A leading # is accepted and blank lines are skipped. A line that cannot
+ * be used is reported with its number and the whole file is refused.
+ */
+#define CONF_MIN_PREFIX 8
+#define CONF_MAX_PREFIX 30
+#define CONF_MAX_FIELDS 16
+
+static char *
+conf_trim(char *s){
+    char *end;
+    while(*s == ' ' || *s == '\t')
+        s++;
+    end = s + strlen(s);
+    while(end > s && (end[-1] == ' ' || end[-1] == '\t'))
+        *--end = '\0';
+    return s;
+}
+
+/*
+ * Dotted quad, each byte in 0..255
+ */
+static int
+conf_parse_ipv4(const char *s, uint32_t *addr){
+    uint32_t value = 0;
+    int i;
+    for(i = 0; i < 4; i++){
+        int byte = 0, digits = 0;
+        while(*s >= '0' && *s <= '9' && digits < 4){
+            byte = byte * 10 + *s++ - '0';
+            digits++;
+        }
+        if(digits == 0 || digits > 3 || byte > 255)
+            return -1;
+        value = value << 8 | byte;
+        if(i < 3 && *s++ != '.')
+            return -1;
+    }
+    if(*s != '\0')
+        return -1;
+    *addr = value;
+    return 0;
+}
+
+static int
+conf_prefix(uint32_t mask){
+    int prefix = 0;
+    while(prefix < 32 && (mask & (0x80000000u >> prefix)))
+        prefix++;
+    // The mask must be contiguous
+    return (prefix == 32 ? 0xffffffffu : ~(0xffffffffu >> prefix)) == mask ? prefix : -1;
+}
+
+/*
+ * The regex syntax of the matcher: a * must follow a character
+ */
+static int
+conf_check_regex(const char *regex){
+    const char *p = regex;
+    if(*p == '\0')
+        return -1;
+    if(*p == '^')
+        p++;
+    while(*p){
+        if(*p == '*')
+            return -1;
+        p += p[1] == '*' ? 2 : 1;
+    }
+    return 0;
+}
+
+/*
+ * exclude= option of a realm
+ */
+static int
+conf_parse_exclude(struct plugin_context *context, int lineno, realm_conf *realm, char *value, uint32_t network, uint32_t mask){
+    char *item, *save = NULL;
+
+    for(item = strtok_r(value, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)){
+        char *slash, *dash;
+        addr_range r, *exclude;
+        item = conf_trim(item);
+        if((slash = strchr(item, '/')) != NULL){
+            char *end;
+            long n;
+            *slash++ = '\0';
+            n = strtol(slash, &end, 10);
+            if(conf_parse_ipv4(item, &r.first) != 0 || end == slash || *end != '\0' || n < 0 || n > 32
+               || (n < 32 && (r.first & (0xffffffffu >> n)))){
+                realm_log(REALM_LOG_ERROR, "%s:%d: invalid excluded network %s/%s", context->plugin_conf, lineno, item, slash);
+                return -1;
+            }
+            r.last = n == 32 ? r.first : r.first | (0xffffffffu >> n);
+        }else if((dash = strchr(item, '-')) != NULL){
+            *dash++ = '\0';
+            if(conf_parse_ipv4(conf_trim(item), &r.first) != 0 || conf_parse_ipv4(conf_trim(dash), &r.last) != 0 || r.first > r.last){
+                realm_log(REALM_LOG_ERROR, "%s:%d: invalid excluded range %s-%s", context->plugin_conf, lineno, item, dash);
+                return -1;
+            }
+        }else{
+            if(conf_parse_ipv4(item, &r.first) != 0){
+                realm_log(REALM_LOG_ERROR, "%s:%d: invalid excluded address %s", context->plugin_conf, lineno, item);
+                return -1;
+            }
+            r.last = r.first;
+        }
+        if((r.first & mask) != network || (r.last & mask) != network){
+            realm_log(REALM_LOG_ERROR, "%s:%d: excluded %s is not in the realm", context->plugin_conf, lineno, item);
+            return -1;
+        }
+        exclude = realloc(realm->exclude, (realm->nexclude + 1) * sizeof(addr_range));
+        if(exclude == NULL){
+            realm_log(REALM_LOG_ERROR, "%s:%d: out of memory", context->plugin_conf, lineno);
+            return -1;
+        }
+        realm->exclude = exclude;
+        realm->exclude[realm->nexclude++] = r;
+    }
+    return 0;
+}
+
+static int
+conf_append(char **text, size_t *len, const char *s){
+    size_t n = strlen(s);
+    char *grown = realloc(*text, *len + n + 1);
+    if(grown == NULL)
+        return -1;
+    memcpy(grown + *len, s, n + 1);
+    *text = grown;
+    *len += n;
+    return 0;
+}
+
+static int
+pf_append(realm_conf *realm, const char *text){
+    return conf_append(&realm->pf, &realm->pf_len, text);
+}
+
+/*
+ * A push line following the realm, kept as is until the realm is complete
+ */
+static int
+conf_parse_push(struct plugin_context *context, int lineno, char *line, realm_conf *realm){
+    size_t len = strlen(line);
+
+    if(realm == NULL){
+        realm_log(REALM_LOG_ERROR, "%s:%d: push before any realm", context->plugin_conf, lineno);
+        return -1;
+    }
+    if(len < 8 || strncmp(line, "push \"", 6) || line[len - 1] != '"'){
+        realm_log(REALM_LOG_ERROR, "%s:%d: expected push \"option\"", context->plugin_conf, lineno);
+        return -1;
+    }
+    if(conf_append(&realm->push, &realm->push_len, line) != 0 || conf_append(&realm->push, &realm->push_len, "\n") != 0){
+        realm_log(REALM_LOG_ERROR, "%s:%d: out of memory", context->plugin_conf, lineno);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compile the configuration of the clients of the realm: its ifconfig-push
+ * line then its push lines, where %address% is the address of the client
+ * and %netmask% the netmask of the realm
+ */
+#define PUSH_ADDRESS "%address%"
+#define PUSH_NETMASK "%netmask%"
+
+static int
+push_compile(struct plugin_context *context, realm_conf *realm){
+    const char *src[2] = { "ifconfig-push " PUSH_ADDRESS " " PUSH_NETMASK "\n", realm->push != NULL ? realm->push : "" };
+    size_t netmask_len = strlen(realm->netmask), size = 0, piece = 0;
+    int i, npieces = 1;
+    push_template *t;
+    char *text;
+
+    // Sizes first, for a single allocation
+    for(i = 0; i < 2; i++){
+        const char *p = src[i];
+        while(*p != '\0'){
+            if(!strncmp(p, PUSH_ADDRESS, sizeof(PUSH_ADDRESS) - 1)){
+                npieces++;
+                p += sizeof(PUSH_ADDRESS) - 1;
+            }else if(!strncmp(p, PUSH_NETMASK, sizeof(PUSH_NETMASK) - 1)){
+                size += netmask_len;
+                p += sizeof(PUSH_NETMASK) - 1;
+            }else{
+                size++;
+                p++;
+            }
+        }
+    }
+    if(size + (npieces - 1) * (ADDRESS_TEXT_SIZE - 1) >= PUSH_CONF_SIZE){
+        realm_log(REALM_LOG_ERROR, "%s: the push lines of %s are longer than %d bytes", context->plugin_conf, realm->network, PUSH_CONF_SIZE - 1);
+        return -1;
+    }
+    t = malloc(sizeof(push_template) + npieces * sizeof(size_t) + size);
+    if(t == NULL){
+        realm_log(REALM_LOG_ERROR, "%s: out of memory", context->plugin_conf);
+        return -1;
+    }
+    t->npieces = 0;
+    t->text = text = (char *) &t->len[npieces];
+    for(i = 0; i < 2; i++){
+        const char *p = src[i];
+        while(*p != '\0'){
+            if(!strncmp(p, PUSH_ADDRESS, sizeof(PUSH_ADDRESS) - 1)){
+                t->len[t->npieces++] = piece;
+                piece = 0;
+                p += sizeof(PUSH_ADDRESS) - 1;
+            }else if(!strncmp(p, PUSH_NETMASK, sizeof(PUSH_NETMASK) - 1)){
+                memcpy(text, realm->netmask, netmask_len);
+                text += netmask_len;
+                piece += netmask_len;
+                p += sizeof(PUSH_NETMASK) - 1;
+            }else{
+                *text++ = *p++;
+                piece++;
+            }
+        }
+    }
+    t->len[t->npieces++] = piece;
+    free(realm->push);
+    realm->push = NULL;
+    realm->push_len = 0;
+    realm->conf = t;
+    return 0;
+}
+
+/*
+ * A line of the pf section of the realm, already trimmed
+ */
+static int
+conf_parse_pf(struct plugin_context *context, int lineno, char *line, realm_conf *realm){
+    int ret = 0;
+
+    if(realm == NULL){
+        realm_log(REALM_LOG_ERROR, "%s:%d: packet filter before any realm", context->plugin_conf, lineno);
+        return -1;
+    }
+    if(realm->pf_section == PF_END){
+        realm_log(REALM_LOG_ERROR, "%s:%d: packet filter after [END]", context->plugin_conf, lineno);
+        return -1;
+    }
+    if(!strcmp(line, "[CLIENTS ACCEPT]") || !strcmp(line, "[CLIENTS DROP]")){
+        if(realm->pf_seen & (PF_CLIENTS | PF_SUBNETS)){
+            realm_log(REALM_LOG_ERROR, "%s:%d: [CLIENTS] must come once, before [SUBNETS]", context->plugin_conf, lineno);
+            return -1;
+        }
+        realm->pf_section = PF_CLIENTS;
+    }else if(!strcmp(line, "[SUBNETS ACCEPT]") || !strcmp(line, "[SUBNETS DROP]")){
+        if(realm->pf_seen & PF_SUBNETS){
+            realm_log(REALM_LOG_ERROR, "%s:%d: [SUBNETS] must come once", context->plugin_conf, lineno);
+            return -1;
+        }
+        if(!(realm->pf_seen & PF_CLIENTS))
+            ret = pf_append(realm, "[CLIENTS ACCEPT]\n");
+        realm->pf_section = PF_SUBNETS;
+    }else if(!strcmp(line, "[END]")){
+        realm->pf_section = PF_END;
+        // Written when the section is complete
+        return 0;
+    }else if((*line == '+' || *line == '-') && realm->pf_section == PF_CLIENTS && line[1] != '\0'){
+        // A common name
+    }else if((*line == '+' || *line == '-') && realm->pf_section == PF_SUBNETS){
+        char *slash = strchr(line + 1, '/'), *end;
+        uint32_t address;
+        long n = 32;
+        if(slash != NULL){
+            *slash = '\0';
+            n = strtol(slash + 1, &end, 10);
+            if(end == slash + 1 || *end != '\0')
+                n = -1;
+        }
+        ret = conf_parse_ipv4(line + 1, &address);
+        if(slash != NULL)
+            *slash = '/';
+        if(ret != 0 || n < 0 || n > 32){
+            realm_log(REALM_LOG_ERROR, "%s:%d: invalid packet filter subnet %s", context->plugin_conf, lineno, line + 1);
+            return -1;
+        }
+    }else{
+        realm_log(REALM_LOG_ERROR, "%s:%d: unexpected packet filter line %s", context->plugin_conf, lineno, line);
+        return -1;
+    }
+    realm->pf_seen |= realm->pf_section;
+    if(ret != 0 || pf_append(realm, line) != 0 || pf_append(realm, "\n") != 0){
+        realm_log(REALM_LOG_ERROR, "%s:%d: out of memory", context->plugin_conf, lineno);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Complete the pf file of the realm with the sections it left out
+ */
+static int
+pf_finish(realm_conf *realm){
+    if(realm->pf == NULL)
+        return 0;
+    if(!(realm->pf_seen & PF_SUBNETS) && pf_append(realm, "[SUBNETS ACCEPT]\n") != 0)
+        return -1;
+    return pf_append(realm, "[END]\n");
+}
+
+/*
+ * Prometheus label value, with backslash, double quote and new line
+ * escaped, out has room for twice the value
+ */
+static char *
+label_escape(char *out, const char *name, const char *value){
+    size_t len = strlen(name);
+    memcpy(out, name, len);
+    out += len;
+    *out++ = '=';
+    *out++ = '"';
+    for(; *value != '\0'; value++){
+        if(*value == '\\' || *value == '"' || *value == '\n')
+            *out++ = '\\';
+        *out++ = *value == '\n' ? 'n' : *value;
+    }
+    *out++ = '"';
+    return out;
+}
+
+/*
+ * Labels of the metrics of the realm, built once so that an export only
+ * copies them
+ */
+static int
+realm_labels(realm_conf *realm){
+    size_t size = sizeof("network=\"\",netmask=\"\",regex=\"\"") + 2 * (strlen(realm->network) + strlen(realm->netmask) + strlen(realm->regex));
+    char *p = realm->labels = malloc(size);
+
+    if(p == NULL)
+        return -1;
+    p = label_escape(p, "network", realm->network);
+    *p++ = ',';
+    p = label_escape(p, "netmask", realm->netmask);
+    *p++ = ',';
+    p = label_escape(p, "regex", realm->regex);
+    *p = '\0';
+    return 0;
+}
+
+/*
+ * Parse one line in place, return 1 for a realm, 0 for a blank line and -1
+ * for an error, which is reported
+ */
+static int
+conf_parse_line(struct plugin_context *context, int lineno, char *line, realm_conf *realm){
+    char *fields[CONF_MAX_FIELDS];
+    char *p, *prefix_str, *netmask_str = NULL;
+    char netmask[16];
+    uint32_t network, mask = 0;
+    int nfields = 0, prefix, i;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    p = conf_trim(line);
+    if(*p == '\0')
+        return 0;
+    if(*p == '#')
+        p++;
+    for(;;){
+        char *sep = strchr(p, '#');
+        if(nfields == CONF_MAX_FIELDS){
+            realm_log(REALM_LOG_ERROR, "%s:%d: too many fields", context->plugin_conf, lineno);
+            return -1;
+        }
+        fields[nfields++] = p;
+        if(sep == NULL)
+            break;
+        *sep = '\0';
+        p = sep + 1;
+        // The line can end with #
+        if(*conf_trim(p) == '\0')
+            break;
+    }
+    if(nfields < 2){
+        realm_log(REALM_LOG_ERROR, "%s:%d: expected network#regex#netmask#", context->plugin_conf, lineno);
+        return -1;
+    }
+    // The netmask is the third field, the options have a =
+    for(i = 2; i < nfields; i++){
+        fields[i] = conf_trim(fields[i]);
+        if(i == 2 && strchr(fields[i], '=') == NULL){
+            netmask_str = fields[i];
+            fields[i] = "";
+        }else if(*fields[i] != '\0' && strchr(fields[i], '=') == NULL){
+            realm_log(REALM_LOG_ERROR, "%s:%d: unexpected field %s", context->plugin_conf, lineno, fields[i]);
+            return -1;
+        }
+    }
+
+    // network, with the prefix length when it is given in CIDR
+    fields[0] = conf_trim(fields[0]);
+    prefix_str = strchr(fields[0], '/');
+    if(prefix_str != NULL)
+        *prefix_str++ = '\0';
+    if(conf_parse_ipv4(fields[0], &network) != 0){
+        realm_log(REALM_LOG_ERROR, "%s:%d: invalid network %s", context->plugin_conf, lineno, fields[0]);
+        return -1;
+    }
+    prefix = -1;
+    if(prefix_str != NULL){
+        char *end;
+        long n = strtol(prefix_str, &end, 10);
+        if(end == prefix_str || *end != '\0' || n < 0 || n > 32){
+            realm_log(REALM_LOG_ERROR, "%s:%d: invalid prefix length /%s", context->plugin_conf, lineno, prefix_str);
+            return -1;
+        }
+        prefix = (int) n;
+        mask = prefix == 0 ? 0 : 0xffffffffu << (32 - prefix);
+    }
+    if(netmask_str != NULL && *netmask_str != '\0'){
+        uint32_t given;
+        if(conf_parse_ipv4(netmask_str, &given) != 0 || conf_prefix(given) < 0){
+            realm_log(REALM_LOG_ERROR, "%s:%d: invalid netmask %s", context->plugin_conf, lineno, netmask_str);
+            return -1;
+        }
+        if(prefix >= 0 && given != mask){
+            realm_log(REALM_LOG_ERROR, "%s:%d: netmask %s does not match /%d", context->plugin_conf, lineno, netmask_str, prefix);
+            return -1;
+        }
+        mask = given;
+        prefix = conf_prefix(given);
+    }
+    if(prefix < 0){
+        realm_log(REALM_LOG_ERROR, "%s:%d: missing netmask", context->plugin_conf, lineno);
+        return -1;
+    }
+    if(prefix < CONF_MIN_PREFIX || prefix > CONF_MAX_PREFIX){
+        realm_log(REALM_LOG_ERROR, "%s:%d: /%d is not supported, the prefix length goes from %d to %d",
+                  context->plugin_conf, lineno, prefix, CONF_MIN_PREFIX, CONF_MAX_PREFIX);
+        return -1;
+    }
+    if(network & ~mask){
+        realm_log(REALM_LOG_ERROR, "%s:%d: %s is not the network address of /%d", context->plugin_conf, lineno, fields[0], prefix);
+        return -1;
+    }
+    for(i = 2; i < nfields; i++){
+        if(*fields[i] == '\0')
+            continue;
+        if(!strncmp(fields[i], "exclude=", 8)){
+            // One instance would give back what another one excluded
+            if(context->shm != NULL){
+                realm_log(REALM_LOG_ERROR, "%s:%d: exclude= cannot be used with shm=, the pool is shared with the other instances", context->plugin_conf, lineno);
+                return -1;
+            }
+            if(conf_parse_exclude(context, lineno, realm, fields[i] + 8, network, mask) != 0)
+                return -1;
+        }else if(!strcmp(fields[i], "policy=first")){
+            realm->policy = REALM_POLICY_FIRST;
+        }else if(!strcmp(fields[i], "policy=hash")){
+            realm->policy = REALM_POLICY_HASH;
+        }else{
+            realm_log(REALM_LOG_ERROR, "%s:%d: unknown option %s", context->plugin_conf, lineno, fields[i]);
+            return -1;
+        }
+    }
+    if(conf_check_regex(fields[1]) != 0){
+        realm_log(REALM_LOG_ERROR, "%s:%d: invalid regex %s", context->plugin_conf, lineno, fields[1]);
+        return -1;
+    }
+
+    sprintf(netmask, "%u.%u.%u.%u", mask >> 24, mask >> 16 & 0xff, mask >> 8 & 0xff, mask & 0xff);
+    realm->network = arena_strdup(&realm->arena, fields[0]);
+    realm->netmask = arena_strdup(&realm->arena, netmask);
+    realm->regex = strdup(fields[1]);
+    if(realm->network == NULL || realm->netmask == NULL || realm->regex == NULL){
+        realm_log(REALM_LOG_ERROR, "%s:%d: out of memory", context->plugin_conf, lineno);
+        return -1;
+    }
+    realm->network_addr = network;
+    realm->prefix = prefix;
+    return 1;
+}
+
+/*
+ * Generate the configuration
+ */
+static int
+get_config(struct plugin_context *context, const char *argv[], const char *envp[])
+{
+    FILE *fh = fopen(context->plugin_conf, "r");
+    char *line = NULL;
+    size_t len = 0;
+    int size = 0, lineno = 0, ret = 0, i;
+
+    context->configs = NULL;
+    context->numRealm = 0;
+    if(fh == NULL){
+        realm_log(REALM_LOG_ERROR, "Could not open %s", context->plugin_conf);
+        return -1;
+    }
+    while(getline(&line, &len, fh) != -1){
+        realm_conf *realm;
+        char *trimmed;
+        lineno++;
+        // The packet filter of the last realm
+        line[strcspn(line, "\r\n")] = '\0';
+        trimmed = conf_trim(line);
+        if(!strncmp(trimmed, "push ", 5)){
+            ret = conf_parse_push(context, lineno, trimmed, context->numRealm ? context->configs[context->numRealm - 1] : NULL);
+            if(ret < 0)
+                break;
+            continue;
+        }
+        if(*trimmed == '[' || *trimmed == '+' || *trimmed == '-'){
+            ret = conf_parse_pf(context, lineno, trimmed, context->numRealm ? context->configs[context->numRealm - 1] : NULL);
+            if(ret < 0)
+                break;
+            continue;
+        }
+        if(context->numRealm == size){
+            realm_conf **configs = realloc(context->configs, (size ? size * 2 : 64) * sizeof(realm_conf *));
+            if(configs == NULL){
+                ret = -1;
+                break;
+            }
+            context->configs = configs;
+            size = size ? size * 2 : 64;
+        }
+        realm = new_realm();
+        if(realm == NULL){
+            ret = -1;
+            break;
+        }
+        ret = conf_parse_line(context, lineno, line, realm);
+        if(ret <= 0){
+            free_realm(realm);
+            if(ret < 0)
+                break;
+            continue;
+        }
+        ret = 0;
+        context->configs[context->numRealm++] = realm;
+        realm_log(REALM_LOG_DEBUG, "Realm number %d: regex %s network %s netmask %s", context->numRealm,
+                  realm->regex, realm->network, realm->netmask);
+    }
+    free(line);
+    fclose(fh);
+    for(i = 0; ret == 0 && i < context->numRealm; i++){
+        if(pf_finish(context->configs[i]) != 0){
+            realm_log(REALM_LOG_ERROR, "%s: out of memory", context->plugin_conf);
+            ret = -1;
+        }else if(context->configs[i]->pf_len >= PF_CONF_SIZE){
+            realm_log(REALM_LOG_ERROR, "%s: the packet filter of %s is longer than %d bytes", context->plugin_conf, context->configs[i]->network, PF_CONF_SIZE - 1);
+            ret = -1;
+        }else if(push_compile(context, context->configs[i]) != 0){
+            ret = -1;
+        }else if(realm_labels(context->configs[i]) != 0){
+            realm_log(REALM_LOG_ERROR, "%s: out of memory", context->plugin_conf);
+            ret = -1;
+        }
+    }
+    if(ret == 0 && context->numRealm == 0){
+        realm_log(REALM_LOG_ERROR, "%s: no realm", context->plugin_conf);
+        ret = -1;
+    }
+    if(ret != 0){
+        for(i = 0; i < context->numRealm; i++)
+            free_realm(context->configs[i]);
+        free(context->configs);
+        context->configs = NULL;
+        context->numRealm = 0;
+    }
+    return ret;
+}
+
+/*
+ * Hot reload: a thread watches plugin.conf and, when it changes, builds a
+ * new set of realms with the same functions as the plugin open. The new
+ * set is published to the openvpn thread which swaps it in at the start
+ * of its next callback. Realms with the same network and netmask are
+ * carried over as is (pool, leases and connected clients included), so
+ * the swap costs one pointer move per realm. Removed realms keep serving
+ * their connected clients until the last one leaves. Everything that must
+ * be freed goes back to the reload thread.
+ */
+#define RELOAD_INTERVAL 1
+
+typedef struct realm_reload{
+    struct realm_reload *next;  // garbage list
+    int numRealm;
+    realm_conf **configs;
+    struct realm_matcher *matcher;
+    realm_conf **by_network;
+    realm_conf **carry;         // old realm replacing each new realm, or NULL
+    char *kept;                 // old realms carried over
+    int numOld;
+}realm_reload;
+
+static int realm_network_cmp(const void *a, const void *b);
+
+/*
+ * Everything but the regex, the exclusions and the orphans list is in the
+ * arena of the realm
+ */
+static void
+free_realm(realm_conf *realm){
+    arena a;
+    if(realm == NULL)
+        return;
+    free(realm->orphans);
+    free(realm->exclude);
+    free(realm->pf);
+    free(realm->push);
+    free(realm->conf);
+    free(realm->labels);
+    free((char *) realm->regex);
+    pool_detach(&realm->pool);
+    a = realm->arena;
+    arena_free(&a);
+}
+
+static void
+free_reload(realm_reload *reload){
+    int i;
+    for(i = 0; i < reload->numRealm; i++)
+        free_realm(reload->configs[i]);
+    free(reload->configs);
+    free(reload->by_network);
+    matcher_free(reload->matcher);
+    free(reload->carry);
+    free(reload->kept);
+    free(reload);
+}
+
+static void
+reload_dispose(struct plugin_context *context, realm_reload *garbage){
+    realm_reload *head = __atomic_load_n(&context->garbage, __ATOMIC_RELAXED);
+    do{
+        garbage->next = head;
+    }while(!__atomic_compare_exchange_n(&context->garbage, &head, garbage, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Hand a realm that has no client anymore to the reload thread
+ */
+static void
+dispose_realm(struct plugin_context *context, realm_conf *realm){
+    realm_reload *garbage = calloc(1, sizeof(realm_reload));
+    if(garbage == NULL || (garbage->configs = malloc(sizeof(realm_conf *))) == NULL){
+        free(garbage);
+        free_realm(realm);
+        return;
+    }
+    garbage->configs[0] = realm;
+    garbage->numRealm = 1;
+    reload_dispose(context, garbage);
+}
+
+/*
+ * A realm removed from the configuration: drop the addresses reserved for
+ * clients that did not come back, and keep it while clients still use it.
+ * Return 0 if the realm is retired, -1 if it can be freed now.
+ */
+static int
+retire_realm(struct plugin_context *context, realm_conf *realm){
+    while(realm->norphans > 0){
+        realm_orphan *orphan = &realm->orphans[--realm->norphans];
+        if(!is_reserved(realm, orphan->index))
+            continue;
+        lease_release(context->leases, orphan->common_name, realm->network_addr, realm->first_addr + orphan->index);
+        set_reserved(realm, orphan->index, 0);
+        realm_release(realm, orphan->index);
+    }
+    if(realm_idle(realm))
+        return -1;
+    realm->retired = 1;
+    realm->retired_next = context->retired;
+    context->retired = realm;
+    return 0;
+}
+
+/*
+ * The last client of a retired realm left
+ */
+static void
+release_retired(struct plugin_context *context, realm_conf *realm){
+    realm_conf **p;
+    for(p = &context->retired; *p != NULL; p = &(*p)->retired_next){
+        if(*p == realm){
+            *p = realm->retired_next;
+            break;
+        }
+    }
+    dispose_realm(context, realm);
+}
+
+/*
+ * Load the realms of the configuration file (plugin open and reload)
+ */
+static int
+load_realms(struct plugin_context *context, const char *argv[], const char *envp[]){
+    // Fetch the configuration
+    if(get_config (context, argv, envp) != 0)
+        return -1;
+    // Generate the subnet
+    if(generate_subnet(context, argv, envp) != 0)
+        return -1;
+    context->by_network = malloc((context->numRealm + 1) * sizeof(realm_conf *));
+    if(context->by_network == NULL)
+        return -1;
+    memcpy(context->by_network, context->configs, context->numRealm * sizeof(realm_conf *));
+    qsort(context->by_network, context->numRealm, sizeof(realm_conf *), realm_network_cmp);
+    // Compile the realm regex
+    context->matcher = matcher_compile(context);
+    return context->matcher != NULL ? 0 : -1;
+}
+
+static int
+same_realm(const realm_conf *a, const realm_conf *b){
+    return a->network_addr == b->network_addr && a->pool.size == b->pool.size && !strcmp(a->netmask, b->netmask);
+}
+
+/*
+ * Build the new realms and find which current realm each one replaces
+ */
+static realm_reload *
+build_reload(struct plugin_context *context){
+    plugin_context tmp;
+    realm_reload *reload = calloc(1, sizeof(realm_reload));
+    realm_conf **sorted = NULL;
+    int i;
+
+    if(reload == NULL)
+        return NULL;
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.plugin_conf = context->plugin_conf;
+    tmp.shm = context->shm;
+    tmp.shm_id = context->shm_id;
+    if(load_realms(&tmp, NULL, NULL) != 0){
+        reload->numRealm = tmp.numRealm > 0 && tmp.configs ? tmp.numRealm : 0;
+        reload->configs = tmp.configs;
+        reload->by_network = tmp.by_network;
+        free_reload(reload);
+        return NULL;
+    }
+    reload->numRealm = tmp.numRealm;
+    reload->configs = tmp.configs;
+    reload->by_network = tmp.by_network;
+    reload->matcher = tmp.matcher;
+    reload->numOld = context->numRealm;
+    reload->carry = calloc(reload->numRealm + 1, sizeof(realm_conf *));
+    reload->kept = calloc(reload->numOld + 1, 1);
+    sorted = malloc((reload->numOld + 1) * sizeof(realm_conf *));
+    if(reload->carry == NULL || reload->kept == NULL || sorted == NULL){
+        free(sorted);
+        free_reload(reload);
+        return NULL;
+    }
+    // The current realms are only swapped by the openvpn thread once this reload is applied
+    memcpy(sorted, context->configs, reload->numOld * sizeof(realm_conf *));
+    qsort(sorted, reload->numOld, sizeof(realm_conf *), realm_network_cmp);
+    for(i = 0; i < reload->numRealm; i++){
+        realm_conf *realm = reload->configs[i];
+        realm_conf **found = bsearch(&realm, sorted, reload->numOld, sizeof(realm_conf *), realm_network_cmp);
+        int j;
+        if(found == NULL)
+            continue;
+        // Several realms may share a network, walk back to the first one
+        while(found > sorted && (*(found - 1))->network_addr == realm->network_addr)
+            found--;
+        for(; found < sorted + reload->numOld && (*found)->network_addr == realm->network_addr; found++){
+            for(j = 0; j < reload->numOld && context->configs[j] != *found; j++)
+                ;
+            if(!reload->kept[j] && same_realm(*found, realm)){
+                reload->kept[j] = 1;
+                reload->carry[i] = *found;
+                break;
+            }
+        }
+    }
+    free(sorted);
+    return reload;
+}
+
+/*
+ * Swap in the realms built by the reload thread, called by the openvpn
+ * thread before each callback
+ */
+static void
+apply_reload(struct plugin_context *context){
+    realm_reload *reload;
+    realm_conf **old;
+    int i, numOld, pf = 0;
+
+    if(__atomic_load_n(&context->reload_next, __ATOMIC_RELAXED) == NULL)
+        return;
+    reload = __atomic_exchange_n(&context->reload_next, NULL, __ATOMIC_ACQUIRE);
+    if(reload == NULL)
+        return;
+    pthread_mutex_lock(&context->lock);
+    for(i = 0; i < reload->numRealm; i++){
+        realm_conf *carry = reload->carry[i];
+        pf |= reload->configs[i]->pf != NULL;
+        if(carry != NULL){
+            // Keep the current realm with its pool, give it the new regex,
+            // packet filter and push lines, for the clients to come
+            const char *regex = carry->regex;
+            char *carry_pf = carry->pf;
+            size_t carry_pf_len = carry->pf_len;
+            push_template *carry_conf = carry->conf;
+            char *carry_labels = carry->labels;
+            carry->conf = reload->configs[i]->conf;
+            reload->configs[i]->conf = carry_conf;
+            carry->labels = reload->configs[i]->labels;
+            reload->configs[i]->labels = carry_labels;
+            carry->regex = reload->configs[i]->regex;
+            reload->configs[i]->regex = regex;
+            carry->pf = reload->configs[i]->pf;
+            carry->pf_len = reload->configs[i]->pf_len;
+            reload->configs[i]->pf = carry_pf;
+            reload->configs[i]->pf_len = carry_pf_len;
+            carry->policy = reload->configs[i]->policy;
+            exclude_update(carry, &reload->configs[i]->exclude, &reload->configs[i]->nexclude);
+            reload->carry[i] = reload->configs[i];
+            reload->configs[i] = carry;
+        }else{
+            share_realm(reload->configs[i], 0);
+        }
+    }
+    old = context->configs;
+    numOld = context->numRealm;
+    context->configs = reload->configs;
+    context->numRealm = reload->numRealm;
+    context->reloads++;
+    reload->configs = reload->carry;
+    reload->carry = NULL;
+    {
+        struct realm_matcher *matcher = context->matcher;
+        realm_conf **by_network = context->by_network;
+        context->matcher = reload->matcher;
+        reload->matcher = matcher;
+        // Sorted again with the carried realms in place of the new ones
+        memcpy(reload->by_network, context->configs, context->numRealm * sizeof(realm_conf *));
+        qsort(reload->by_network, context->numRealm, sizeof(realm_conf *), realm_network_cmp);
+        context->by_network = reload->by_network;
+        reload->by_network = by_network;
+    }
+    // The realms that are gone wait for their clients to leave
+    for(i = 0; i < numOld; i++){
+        if(reload->kept[i] || retire_realm(context, old[i]) == 0)
+            old[i] = NULL;
+    }
+    pthread_mutex_unlock(&context->lock);
+    if(pf && !context->pf)
+        realm_log(REALM_LOG_WARN, "%s now has a packet filter, openvpn must be restarted to enable it", context->plugin_conf);
+    // What is left is freed by the reload thread with the replaced realms
+    free(reload->kept);
+    reload->kept = NULL;
+    reload_dispose(context, reload);
+    {
+        realm_reload *gone = calloc(1, sizeof(realm_reload));
+        if(gone != NULL){
+            gone->configs = old;
+            gone->numRealm = numOld;
+            reload_dispose(context, gone);
+        }else{
+            for(i = 0; i < numOld; i++)
+                free_realm(old[i]);
+            free(old);
+        }
+    }
+    __atomic_store_n(&context->reload_busy, 0, __ATOMIC_RELEASE);
+    realm_log(REALM_LOG_INFO, "Configuration reloaded, %d realms", context->numRealm);
+}
+
+static void
+free_garbage(struct plugin_context *context){
+    realm_reload *garbage = __atomic_exchange_n(&context->garbage, NULL, __ATOMIC_ACQUIRE);
+    while(garbage != NULL){
+        realm_reload *next = garbage->next;
+        free_reload(garbage);
+        garbage = next;
+    }
+}
+
+static int
+conf_changed(const struct stat *a, const struct stat *b){
+    return a->st_ino != b->st_ino || a->st_size != b->st_size
+        || a->st_mtim.tv_sec != b->st_mtim.tv_sec || a->st_mtim.tv_nsec != b->st_mtim.tv_nsec;
+}
+
+/*
+ * Watch the configuration file. A change is only loaded once the file did
+ * not move for a whole interval, so a file being written is not read.
+ */
+static void *
+reload_thread(void *arg){
+    struct plugin_context *context = (struct plugin_context *) arg;
+    struct stat seen = context->conf_stat;
+    struct stat st;
+    struct timespec ts;
+
+    pthread_mutex_lock(&context->reload_lock);
+    while(!context->reload_stop){
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += RELOAD_INTERVAL;
+        pthread_cond_timedwait(&context->reload_cond, &context->reload_lock, &ts);
+        if(context->reload_stop)
+            break;
+        pthread_mutex_unlock(&context->reload_lock);
+
+        free_garbage(context);
+        // Release the holds that expired while nobody connected
+        if(context->grace > 0){
+            pthread_mutex_lock(&context->lock);
+            hold_expire(context);
+            pthread_mutex_unlock(&context->lock);
+        }
+        // plugin_log can only be called from the openvpn thread
+        if(logger.plugin_log == NULL)
+            log_flush();
+        // The previous reload must be applied before building a new one
+        if(!__atomic_load_n(&context->reload_busy, __ATOMIC_ACQUIRE) && stat(context->plugin_conf, &st) == 0){
+            if(conf_changed(&st, &seen)){
+                seen = st;
+            }else if(conf_changed(&st, &context->conf_stat)){
+                realm_reload *reload;
+                context->conf_stat = st;
+                reload = build_reload(context);
+                if(reload != NULL){
+                    __atomic_store_n(&context->reload_busy, 1, __ATOMIC_RELAXED);
+                    __atomic_store_n(&context->reload_next, reload, __ATOMIC_RELEASE);
+                }else{
+                    realm_log(REALM_LOG_WARN, "Could not reload %s, keeping the current configuration", context->plugin_conf);
+                }
+            }
+        }
+        pthread_mutex_lock(&context->reload_lock);
+    }
+    pthread_mutex_unlock(&context->reload_lock);
+    return NULL;
+}
+
+static int
+start_reload(struct plugin_context *context){
+    pthread_mutex_init(&context->reload_lock, NULL);
+    pthread_cond_init(&context->reload_cond, NULL);
+    stat(context->plugin_conf, &context->conf_stat);
+    if(pthread_create(&context->reload_thread, NULL, reload_thread, context) != 0)
+        return -1;
+    context->reload_running = 1;
+    return 0;
+}
+
+static void
+stop_reload(struct plugin_context *context){
+    realm_reload *pending;
+    if(context->reload_running){
+        pthread_mutex_lock(&context->reload_lock);
+        context->reload_stop = 1;
+        pthread_cond_signal(&context->reload_cond);
+        pthread_mutex_unlock(&context->reload_lock);
+        pthread_join(context->reload_thread, NULL);
+        context->reload_running = 0;
+    }
+    pending = __atomic_exchange_n(&context->reload_next, NULL, __ATOMIC_ACQUIRE);
+    if(pending != NULL)
+        free_reload(pending);
+    free_garbage(context);
+    while(context->retired != NULL){
+        realm_conf *realm = context->retired;
+        context->retired = realm->retired_next;
+        free_realm(realm);
+    }
+}
+
+/*
+ * Metrics export, in the Prometheus text format: written every
+ * stats-interval seconds in the stats file (renamed in place, so it can be
+ * read by the textfile collector of node_exporter), and sent to whoever
+ * connects to the stats socket. The text is built under the context lock,
+ * the file and socket writes are done without it.
+ */
+#define STATS_INTERVAL 10
+#define STATS_PREFIX "openvpn_realm_"
+
+typedef struct stats_buf{
+    char *data;
+    size_t len;
+    size_t size;
+    int failed;
+}stats_buf;
+
+static void __attribute__((format(printf, 2, 3)))
+stats_printf(stats_buf *b, const char *format, ...){
+    va_list ap;
+    int n;
+
+    for(;;){
+        if(b->failed)
+            return;
+        va_start(ap, format);
+        n = vsnprintf(b->data + b->len, b->size - b->len, format, ap);
+        va_end(ap);
+        if(n < 0){
+            b->failed = 1;
+            return;
+        }
+        if((size_t) n < b->size - b->len){
+            b->len += n;
+            return;
+        }
+        {
+            size_t size = b->size * 2 > b->len + n + 1 ? b->size * 2 : b->len + n + 1;
+            char *data = realloc(b->data, size);
+            if(data == NULL){
+                b->failed = 1;
+                return;
+            }
+            b->data = data;
+            b->size = size;
+        }
+    }
+}
+
+/*
+ * Counters of a realm, copied under the context lock so that the text is
+ * formatted without it. label is the offset of the labels of the realm in
+ * the copied text.
+ */
+typedef struct stats_realm_copy{
+    size_t label;
+    int free;
+    int used;
+    int held;
+    int excluded;
+    uint64_t connects;
+    uint64_t disconnects;
+    uint64_t reconnects;
+    uint64_t floats;
+    uint64_t conflicts;
+    uint64_t alloc_failures;
+}stats_realm_copy;
+
+typedef struct stats_copy{
+    stats_realm_copy *realms;
+    int n;
+    int size;
+    char *labels;
+    size_t labels_size;
+    uint64_t unmatched;
+}stats_copy;
+
+static void
+stats_realm(stats_buf *b, const char *metric, const stats_copy *copy, int i, const char *state){
+    stats_printf(b, STATS_PREFIX "%s{%s", metric, copy->labels + copy->realms[i].label);
+    if(state != NULL)
+        stats_printf(b, ",state=\"%s\"", state);
+    stats_printf(b, "} ");
+}
+
+/*
+ * Copy the counters of every realm, the context lock is taken again with
+ * more room when a reload brought more realms in the meantime
+ */
+static int
+stats_take(struct plugin_context *context, stats_copy *copy){
+    for(;;){
+        size_t labels_size = 0;
+        int i, n;
+
+        pthread_mutex_lock(&context->lock);
+        n = context->numRealm;
+        for(i = 0; i < n; i++)
+            labels_size += strlen(context->configs[i]->labels) + 1;
+        if(n <= copy->size && labels_size <= copy->labels_size){
+            size_t label = 0;
+            for(i = 0; i < n; i++){
+                const realm_conf *realm = context->configs[i];
+                stats_realm_copy *r = &copy->realms[i];
+                size_t len = strlen(realm->labels) + 1;
+                memcpy(copy->labels + label, realm->labels, len);
+                r->label = label;
+                label += len;
+                r->free = pool_free_count(&realm->pool);
+                r->used = realm->pool.nused - realm->nheld;
+                r->held = realm->nheld;
+                r->excluded = realm->nexcluded;
+                r->connects = realm->connects;
+                r->disconnects = realm->disconnects;
+                r->reconnects = realm->reconnects;
+                r->floats = realm->floats;
+                r->conflicts = realm->conflicts;
+                r->alloc_failures = realm->alloc_failures;
+            }
+            copy->n = n;
+            copy->unmatched = context->unmatched;
+            pthread_mutex_unlock(&context->lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&context->lock);
+        free(copy->realms);
+        free(copy->labels);
+        copy->realms = malloc((n ? n : 1) * sizeof(stats_realm_copy));
+        copy->labels = malloc(labels_size ? labels_size : 1);
+        if(copy->realms == NULL || copy->labels == NULL)
+            return -1;
+        copy->size = n;
+        copy->labels_size = labels_size;
+    }
+}
+
+static void
+stats_latency(stats_buf *b, const latency_histogram *h){
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count = 0, seen = 0;
+    int i, shift, q;
+
+    for(i = 0; i < LATENCY_BUCKETS; i++){
+        buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        count += buckets[i];
+    }
+    // Cumulative buckets at each power of two, from 1us to about a minute
+    stats_printf(b, "# HELP " STATS_PREFIX "connect_duration_seconds Time to hand an address to a client\n"
+                    "# TYPE " STATS_PREFIX "connect_duration_seconds histogram\n");
+    i = 0;
+    for(shift = 10; shift <= LATENCY_MAX_SHIFT + LATENCY_SUB_BITS; shift++){
+        for(; i < LATENCY_BUCKETS - 1 && latency_bucket_max(i) < ((uint64_t) 1 << shift); i++)
+            seen += buckets[i];
+        stats_printf(b, STATS_PREFIX "connect_duration_seconds_bucket{le=\"%.9g\"} %llu\n",
+                     (double) ((uint64_t) 1 << shift) / 1e9, (unsigned long long) seen);
+    }
+    stats_printf(b, STATS_PREFIX "connect_duration_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long) count);
+    stats_printf(b, STATS_PREFIX "connect_duration_seconds_sum %.9f\n",
+                 (double) __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e9);
+    stats_printf(b, STATS_PREFIX "connect_duration_seconds_count %llu\n", (unsigned long long) count);
+
+    // Quantiles from the full resolution histogram
+    stats_printf(b, "# HELP " STATS_PREFIX "connect_duration_quantile_seconds Connect time quantiles since the start\n"
+                    "# TYPE " STATS_PREFIX "connect_duration_quantile_seconds gauge\n");
+    seen = 0;
+    i = 0;
+    for(q = 0; q < (int) (sizeof(quantiles) / sizeof(quantiles[0])); q++){
+        uint64_t rank = (uint64_t) (quantiles[q] * count + 0.5);
+        uint64_t value = 0;
+        if(rank == 0)
+            rank = 1;
+        if(count > 0){
+            for(; i < LATENCY_BUCKETS - 1 && seen + buckets[i] < rank; i++)
+                seen += buckets[i];
+            value = latency_bucket_max(i);
+        }
+        stats_printf(b, STATS_PREFIX "connect_duration_quantile_seconds{quantile=\"%g\"} %.9g\n",
+                     quantiles[q], (double) value / 1e9);
+    }
+}
+
+static int
+stats_render(struct plugin_context *context, stats_buf *b){
+    stats_copy copy = { NULL, 0, 0, NULL, 0, 0 };
+    int i;
+
+    if(stats_take(context, &copy) != 0){
+        free(copy.realms);
+        free(copy.labels);
+        return -1;
+    }
+    stats_printf(b, "# HELP " STATS_PREFIX "addresses Addresses of the realm pool\n"
+                    "# TYPE " STATS_PREFIX "addresses gauge\n");
+    for(i = 0; i < copy.n; i++){
+        stats_realm(b, "addresses", &copy, i, "free");
+        stats_printf(b, "%d\n", copy.realms[i].free);
+        stats_realm(b, "addresses", &copy, i, "used");
+        stats_printf(b, "%d\n", copy.realms[i].used);
+        stats_realm(b, "addresses", &copy, i, "held");
+        stats_printf(b, "%d\n", copy.realms[i].held);
+        stats_realm(b, "addresses", &copy, i, "excluded");
+        stats_printf(b, "%d\n", copy.realms[i].excluded);
+    }
+    stats_printf(b, "# HELP " STATS_PREFIX "connects_total Addresses given to clients\n"
+                    "# TYPE " STATS_PREFIX "connects_total counter\n");
+    for(i = 0; i < copy.n; i++){
+        stats_realm(b, "connects_total", &copy, i, NULL);
+        stats_printf(b, "%llu\n", (unsigned long long) copy.realms[i].connects);
+    }
+    stats_printf(b, "# HELP " STATS_PREFIX "disconnects_total Addresses given back by clients\n"
+                    "# TYPE " STATS_PREFIX "disconnects_total counter\n");
+    for(i = 0; i < copy.n; i++){
+        stats_realm(b, "disconnects_total", &copy, i, NULL);
+        stats_printf(b, "%llu\n", (unsigned long long) copy.realms[i].disconnects);
+    }
+    stats_printf(b, "# HELP " STATS_PREFIX "reconnects_total Clients given back their address within the grace period\n"
+                    "# TYPE " STATS_PREFIX "reconnects_total counter\n");
+    for(i = 0; i < copy.n; i++){
+        stats_realm(b, "reconnects_total", &copy, i, NULL);
+        stats_printf(b, "%llu\n", (unsigned long long) copy.realms[i].reconnects);
+    }
+    stats_printf(b, "# HELP " STATS_PREFIX "floats_total Clients whose real address changed\n"
+                    "# TYPE " STATS_PREFIX "floats_total counter\n");
+    for(i = 0; i < copy.n; i++){
+        stats_realm(b, "floats_total", &copy, i, NULL);
+        stats_printf(b, "%llu\n", (unsigned long long) copy.realms[i].floats);
+    }
+    stats_printf(b, "# HELP " STATS_PREFIX "conflicts_total Addresses routed to a client while the plugin gave them to another one\n"
+                    "# TYPE " STATS_PREFIX "conflicts_total counter\n");
+    for(i = 0; i < copy.n; i++){
+        stats_realm(b, "conflicts_total", &copy, i, NULL);
+        stats_printf(b, "%llu\n", (unsigned long long) copy.realms[i].conflicts);
+    }
+    stats_printf(b, "# HELP " STATS_PREFIX "allocation_failures_total Clients refused because the realm was full\n"
+                    "# TYPE " STATS_PREFIX "allocation_failures_total counter\n");
+    for(i = 0; i < copy.n; i++){
+        stats_realm(b, "allocation_failures_total", &copy, i, NULL);
+        stats_printf(b, "%llu\n", (unsigned long long) copy.realms[i].alloc_failures);
+    }
+    stats_printf(b, "# HELP " STATS_PREFIX "unmatched_total Clients whose common name matched no realm\n"
+                    "# TYPE " STATS_PREFIX "unmatched_total counter\n"
+                    STATS_PREFIX "unmatched_total %llu\n", (unsigned long long) copy.unmatched);
+    free(copy.realms);
+    free(copy.labels);
+    stats_latency(b, &context->latency);
+    return b->failed ? -1 : 0;
+}
+
+static int
+stats_write_file(struct plugin_context *context){
+    stats_buf b = { NULL, 0, 0, 0 };
+    char tmp[PATH_MAX];
+    int ret = -1;
+
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", context->stats_file) < (int) sizeof(tmp)
+       && stats_render(context, &b) == 0){
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd >= 0){
+            int ok = write(fd, b.data, b.len) == (ssize_t) b.len;
+            if(close(fd) == 0 && ok && rename(tmp, context->stats_file) == 0)
+                ret = 0;
+            else
+                unlink(tmp);
+        }
+    }
+    free(b.data);
+    return ret;
+}
+
+/*
+ * Answer one connection of the stats socket with the current metrics
+ */
+static void
+stats_serve(struct plugin_context *context){
+    struct timeval tv = { 1, 0 };
+    stats_buf b = { NULL, 0, 0, 0 };
+    size_t done = 0;
+    int fd = accept(context->stats_fd, NULL, NULL);
+
+    if(fd < 0)
+        return;
+    // A client that does not read must not hold the thread
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if(stats_render(context, &b) == 0){
+        while(done < b.len){
+            ssize_t n = send(fd, b.data + done, b.len - done, MSG_NOSIGNAL);
+            if(n <= 0)
+                break;
+            done += n;
+        }
+    }
+    free(b.data);
+    close(fd);
+}
+
+static void *
+stats_thread(void *arg){
+    struct plugin_context *context = (struct plugin_context *) arg;
+    struct pollfd fds[2];
+    uint64_t next = 0;
+
+    fds[0].fd = context->stats_pipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = context->stats_socket != NULL ? context->stats_fd : -1;
+    fds[1].events = POLLIN;
+    for(;;){
+        int timeout = -1;
+        if(context->stats_file != NULL){
+            uint64_t now = latency_now() / 1000000;
+            if(now >= next){
+                if(stats_write_file(context) != 0)
+                    realm_log(REALM_LOG_WARN, "Could not write the metrics in %s", context->stats_file);
+                next = now + (uint64_t) context->stats_interval * 1000;
+            }
+            timeout = (int) (next - now);
+        }
+        if(poll(fds, 2, timeout) < 0 && errno != EINTR)
+            break;
+        if(fds[0].revents != 0)
+            break;
+        if(fds[1].revents & POLLIN)
+            stats_serve(context);
+    }
+    return NULL;
+}
+
+static int
+stats_listen(const char *path){
+    struct sockaddr_un addr;
+    int fd;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+    // Left over by a previous run
+    unlink(path);
+    if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 8) != 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+start_stats(struct plugin_context *context){
+    if(context->stats_file == NULL && context->stats_socket == NULL)
+        return 0;
+    if(context->stats_interval <= 0)
+        context->stats_interval = STATS_INTERVAL;
+    context->stats_fd = -1;
+    if(context->stats_socket != NULL && (context->stats_fd = stats_listen(context->stats_socket)) < 0)
+        return -1;
+    if(pipe(context->stats_pipe) != 0){
+        close(context->stats_fd);
+        return -1;
+    }
+    if(pthread_create(&context->stats_thread, NULL, stats_thread, context) != 0){
+        close(context->stats_pipe[0]);
+        close(context->stats_pipe[1]);
+        close(context->stats_fd);
+        return -1;
+    }
+    context->stats_running = 1;
+    return 0;
+}
+
+/*
+ * Wake a thread polling the read end of the pipe. Only a full pipe makes
+ * the write fail, and then the thread is woken already.
+ */
+static void
+wake_thread(int fd){
+    ssize_t n;
+    do
+        n = write(fd, "", 1);
+    while(n < 0 && errno == EINTR);
+}
+
+static void
+stop_stats(struct plugin_context *context){
+    if(!context->stats_running)
+        return;
+    wake_thread(context->stats_pipe[1]);
+    pthread_join(context->stats_thread, NULL);
+    close(context->stats_pipe[0]);
+    close(context->stats_pipe[1]);
+    if(context->stats_fd >= 0){
+        close(context->stats_fd);
+        unlink(context->stats_socket);
+    }
+    context->stats_running = 0;
+}
+
+/*
+ * Admin socket: one command per line, answered with lines ending with
+ * "ok" or a single "error ..." line
+ *
+ *   list [NETWORK]      leases, of every realm or of the realm NETWORK:
+ *                       common name, address, realm and state (connected,
+ *                       held for N seconds, reserved since the restart)
+ *   lookup ADDRESS|CN   the lease of an address or a common name
+ *   release ADDRESS     give back an address nobody is using anymore: held,
+ *                       reserved for a client that did not come back, or
+ *                       taken out of the pool without a lease
+ *   stats               size, free, used, held, excluded and reserved
+ *                       addresses of each realm
+ *
+ * The socket is served by its own thread with epoll, without blocking on
+ * a slow client. list and lookup work on a copy of the leases, taken
+ * ADMIN_BATCH entries or ADMIN_BATCH_NS at a time so the context lock is
+ * only held shortly, and the thread yields between two batches so openvpn
+ * gets the lock first; the copy is consistent as it is started again when
+ * the clients, the holds or the realms changed in between, and the command
+ * answers busy when they keep changing.
+ */
+#define ADMIN_BATCH 1024
+#define ADMIN_BATCH_NS 50000
+#define ADMIN_RETRIES 8
+#define ADMIN_MAX_CONNS 16
+#define ADMIN_LINE_SIZE 512
+
+#define ADMIN_CONNECTED 0
+#define ADMIN_HELD 1
+#define ADMIN_RESERVED 2
+
+typedef struct admin_lease{
+    char common_name[COMMON_NAME_SIZE];
+    uint32_t address;
+    uint32_t network;
+    int prefix;
+    int state;
+    // Seconds left for a held address
+    int ttl;
+}admin_lease;
+
+typedef struct admin_snapshot{
+    admin_lease *leases;
+    int count;
+    int size;
+    uint32_t clients_changes;
+    uint32_t holds_changes;
+    uint32_t reloads;
+}admin_snapshot;
+
+typedef struct admin_conn{
+    int fd;
+    int slot;
+    char in[ADMIN_LINE_SIZE];
+    size_t in_len;
+    stats_buf out;
+    size_t sent;
+}admin_conn;
+
+static int
+admin_add(admin_snapshot *snap, const char *common_name, const realm_conf *realm, int index, int state, int ttl){
+    admin_lease *lease;
+    if(snap->count == snap->size){
+        int size = snap->size ? snap->size * 2 : 256;
+        admin_lease *leases = realloc(snap->leases, size * sizeof(admin_lease));
+        if(leases == NULL)
+            return -1;
+        snap->leases = leases;
+        snap->size = size;
+    }
+    lease = &snap->leases[snap->count++];
+    strcpy(lease->common_name, common_name);
+    lease->address = realm->first_addr + index;
+    lease->network = realm->network_addr;
+    lease->prefix = realm->prefix;
+    lease->state = state;
+    lease->ttl = ttl;
+    return 0;
+}
+
+/*
+ * Where a copy of the leases is: a slot of the client index then of the
+ * hold index, then an orphan of a realm
+ */
+typedef struct admin_cursor{
+    uint32_t slot;
+    int realm;
+    int orphan;
+}admin_cursor;
+
+/*
+ * Copy at most ADMIN_BATCH entries from the cursor, for ADMIN_BATCH_NS at
+ * most, the caller holds the context lock. Return 1 once everything is
+ * copied, -1 when out of memory.
+ */
+static int
+admin_copy(struct plugin_context *context, admin_snapshot *snap, admin_cursor *cursor){
+    cn_index *clients = &context->clients, *holds = &context->holds.index;
+    uint64_t now = hold_clock(), deadline = latency_now() + ADMIN_BATCH_NS;
+    int budget = ADMIN_BATCH;
+
+    for(; budget > 0 && cursor->slot < clients->capacity + holds->capacity; budget--, cursor->slot++){
+        // The clock is only read every 64 entries
+        if(!(budget & 63) && latency_now() > deadline)
+            return 0;
+        if(cursor->slot < clients->capacity){
+            const struct plugin_per_client_context *client = clients->slots[cursor->slot].item;
+            if(client != NULL && admin_add(snap, client->common_name, client->realm, client->index, ADMIN_CONNECTED, 0) != 0)
+                return -1;
+        }else{
+            const lease_hold *hold = holds->slots[cursor->slot - clients->capacity].item;
+            if(hold != NULL && admin_add(snap, hold->common_name, hold->realm, hold->index, ADMIN_HELD,
+                                         hold->expires > now ? (int) (hold->expires - now) : 0) != 0)
+                return -1;
+        }
+    }
+    // Orphans still reserved
+    for(; budget > 0 && cursor->realm < context->numRealm; budget--){
+        realm_conf *realm = context->configs[cursor->realm];
+        realm_orphan *orphan;
+        if(!(budget & 63) && latency_now() > deadline)
+            return 0;
+        if(cursor->orphan >= realm->norphans){
+            cursor->realm++;
+            cursor->orphan = 0;
+            continue;
+        }
+        orphan = &realm->orphans[cursor->orphan++];
+        if(is_reserved(realm, orphan->index) && admin_add(snap, orphan->common_name, realm, orphan->index, ADMIN_RESERVED, 0) != 0)
+            return -1;
+    }
+    return cursor->realm >= context->numRealm;
+}
+
+/*
+ * The clients, the holds or the realms changed since the copy started,
+ * the caller holds the context lock
+ */
+static int
+admin_changed(struct plugin_context *context, const admin_snapshot *snap){
+    return context->clients.changes != snap->clients_changes || context->holds.index.changes != snap->holds_changes
+           || context->reloads != snap->reloads;
+}
+
+static int
+admin_lease_cmp(const void *a, const void *b){
+    const admin_lease *la = a, *lb = b;
+    return la->address < lb->address ? -1 : la->address > lb->address;
+}
+
+/*
+ * Copy the leases, sorted by address. The lock is only held for a batch
+ * at a time; when the leases keep changing under the copy, give up after
+ * ADMIN_RETRIES attempts rather than holding the lock for the whole copy.
+ */
+static int
+admin_snapshot_take(struct plugin_context *context, admin_snapshot *snap){
+    int attempt;
+
+    for(attempt = 0; attempt < ADMIN_RETRIES; attempt++){
+        admin_cursor cursor = { 0, 0, 0 };
+        int ret;
+
+        snap->count = 0;
+        pthread_mutex_lock(&context->lock);
+        snap->clients_changes = context->clients.changes;
+        snap->holds_changes = context->holds.index.changes;
+        snap->reloads = context->reloads;
+        while((ret = admin_copy(context, snap, &cursor)) == 0){
+            // Let openvpn in, then check nothing moved
+            pthread_mutex_unlock(&context->lock);
+            sched_yield();
+            pthread_mutex_lock(&context->lock);
+            if(admin_changed(context, snap)){
+                ret = 2;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&context->lock);
+        if(ret < 0)
+            return -1;
+        if(ret == 1){
+            if(snap->count > 1)
+                qsort(snap->leases, snap->count, sizeof(admin_lease), admin_lease_cmp);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void
+admin_print_lease(stats_buf *b, const admin_lease *lease){
+    char address[ADDRESS_TEXT_SIZE], network[ADDRESS_TEXT_SIZE];
+    static const char *const states[] = { "connected", "held", "reserved" };
+    stats_printf(b, "%s %s %s/%d %s", lease->common_name, format_address(lease->address, address),
+                 format_address(lease->network, network), lease->prefix, states[lease->state]);
+    if(lease->state == ADMIN_HELD)
+        stats_printf(b, " %d", lease->ttl);
+    stats_printf(b, "\n");
+}
+
+static int
+admin_list(struct plugin_context *context, stats_buf *b, const char *arg){
+    admin_snapshot snap = { NULL, 0, 0, 0, 0, 0 };
+    uint32_t network = 0;
+    int i;
+
+    if(*arg != '\0' && conf_parse_ipv4(arg, &network) != 0){
+        stats_printf(b, "error invalid network %s\n", arg);
+        return 0;
+    }
+    if(admin_snapshot_take(context, &snap) != 0){
+        free(snap.leases);
+        return -1;
+    }
+    for(i = 0; i < snap.count; i++){
+        if(*arg == '\0' || snap.leases[i].network == network)
+            admin_print_lease(b, &snap.leases[i]);
+    }
+    stats_printf(b, "ok\n");
+    free(snap.leases);
+    return 0;
+}
+
+static int
+admin_lookup(struct plugin_context *context, stats_buf *b, const char *arg){
+    admin_snapshot snap = { NULL, 0, 0, 0, 0, 0 };
+    uint32_t address;
+    int by_address = conf_parse_ipv4(arg, &address) == 0, i, found = 0;
+
+    if(*arg == '\0'){
+        stats_printf(b, "error lookup needs an address or a common name\n");
+        return 0;
+    }
+    if(admin_snapshot_take(context, &snap) != 0){
+        free(snap.leases);
+        return -1;
+    }
+    for(i = 0; i < snap.count; i++){
+        if(by_address ? snap.leases[i].address == address : !strcmp(snap.leases[i].common_name, arg)){
+            admin_print_lease(b, &snap.leases[i]);
+            found = 1;
+        }
+    }
+    if(found)
+        stats_printf(b, "ok\n");
+    else
+        stats_printf(b, "error no lease for %s\n", arg);
+    free(snap.leases);
+    return 0;
+}
+
+static int
+pool_used(const ip_pool *pool, int index){
+    return (__atomic_load_n(&pool->bits[index / 64], __ATOMIC_RELAXED) >> (index % 64)) & 1;
+}
+
+/*
+ * Give the address back, the caller holds the context lock. The owner is
+ * looked up in place, nothing is copied: an orphan in the realm, a hold
+ * when the realm has some, a client through its route, and only then the
+ * clients that have no route yet.
+ */
+static void
+admin_release_locked(struct plugin_context *context, stats_buf *b, realm_conf *realm, uint32_t address){
+    int index = (int) (address - realm->first_addr), i;
+    learned_addr *learned;
+
+    if(is_reserved(realm, index)){
+        for(i = 0; i < realm->norphans && realm->orphans[i].index != index; i++)
+            ;
+        set_reserved(realm, index, 0);
+        if(i < realm->norphans)
+            lease_release(context->leases, realm->orphans[i].common_name, realm->network_addr, address);
+        realm_release(realm, index);
+        goto released;
+    }
+    for(i = 0; realm->nheld > 0 && i < (int) context->holds.index.capacity; i++){
+        lease_hold *hold = context->holds.index.slots[i].item;
+        if(hold != NULL && hold->realm == realm && hold->index == index){
+            hold_remove(&context->holds, hold);
+            realm_release(realm, index);
+            goto released;
+        }
+    }
+    learned = learn_find(&context->learned, address);
+    if(learned != NULL && learned->realm == NULL && learned->client->realm == realm && learned->client->index == index){
+        stats_printf(b, "error in use by %s\n", learned->client->common_name);
+        return;
+    }
+    for(i = 0; i < (int) context->clients.capacity; i++){
+        const struct plugin_per_client_context *client = context->clients.slots[i].item;
+        if(client != NULL && client->realm == realm && client->index == index){
+            stats_printf(b, "error in use by %s\n", client->common_name);
+            return;
+        }
+    }
+    if(learned != NULL && learned->realm == realm){
+        stats_printf(b, "error routed to %s\n", learned->client->common_name);
+        return;
+    }
+    if(is_excluded(realm, index)){
+        stats_printf(b, "error excluded\n");
+        return;
+    }
+    if(!pool_used(&realm->pool, index)){
+        stats_printf(b, "error not used\n");
+        return;
+    }
+    if(realm->pool.shared != NULL && realm->pool.owner[index] != (uint8_t) realm->pool.id){
+        stats_printf(b, "error taken by instance %d\n", realm->pool.owner[index]);
+        return;
+    }
+    realm_release(realm, index);
+released:
+    realm_log(REALM_LOG_INFO, "Address %d of %s released from the admin socket", index, realm->network);
+    if(realm->retired && realm_idle(realm))
+        release_retired(context, realm);
+    stats_printf(b, "ok\n");
+}
+
+/*
+ * Release an address under a single hold of the lock, without copying
+ * the leases
+ */
+static int
+admin_release(struct plugin_context *context, stats_buf *b, const char *arg){
+    realm_conf *realm;
+    uint32_t address;
+
+    if(conf_parse_ipv4(arg, &address) != 0){
+        stats_printf(b, "error release needs an address\n");
+        return 0;
+    }
+    pthread_mutex_lock(&context->lock);
+    realm = realm_of_address(context, address);
+    if(realm == NULL || address < realm->first_addr || address - realm->first_addr >= (uint32_t) realm->pool.size)
+        stats_printf(b, "error %s is not in a realm pool\n", arg);
+    else
+        admin_release_locked(context, b, realm, address);
+    pthread_mutex_unlock(&context->lock);
+    return 0;
+}
+
+typedef struct admin_realm_stats{
+    uint32_t network;
+    int prefix;
+    int size;
+    int free;
+    int used;
+    int held;
+    int excluded;
+    int reserved;
+}admin_realm_stats;
+
+/*
+ * The counters of each realm are copied under the lock, and formatted
+ * once it is released
+ */
+static int
+admin_stats(struct plugin_context *context, stats_buf *b){
+    admin_realm_stats *stats = NULL;
+    int i, n = 0, size = 0;
+    char network[ADDRESS_TEXT_SIZE];
+
+    for(;;){
+        pthread_mutex_lock(&context->lock);
+        n = context->numRealm;
+        if(n <= size){
+            for(i = 0; i < n; i++){
+                const realm_conf *realm = context->configs[i];
+                stats[i].network = realm->network_addr;
+                stats[i].prefix = realm->prefix;
+                stats[i].size = realm->pool.size;
+                stats[i].free = pool_free_count(&realm->pool);
+                stats[i].used = realm->pool.nused - realm->nheld - realm->nreserved;
+                stats[i].held = realm->nheld;
+                stats[i].excluded = realm->nexcluded;
+                stats[i].reserved = realm->nreserved;
+            }
+        }
+        pthread_mutex_unlock(&context->lock);
+        if(n <= size)
+            break;
+        // A reload brought more realms
+        free(stats);
+        size = n;
+        stats = malloc(size * sizeof(admin_realm_stats));
+        if(stats == NULL)
+            return -1;
+    }
+    for(i = 0; i < n; i++){
+        stats_printf(b, "%s/%d size %d free %d used %d held %d excluded %d reserved %d\n",
+                     format_address(stats[i].network, network), stats[i].prefix, stats[i].size, stats[i].free,
+                     stats[i].used, stats[i].held, stats[i].excluded, stats[i].reserved);
+    }
+    free(stats);
+    stats_printf(b, "ok\n");
+    return 0;
+}
+
+/*
+ * Run one command line, the answer goes in the output of the connection
+ */
+static void
+admin_command(struct plugin_context *context, stats_buf *b, char *line){
+    char *arg;
+    int ret = 0;
+
+    line = conf_trim(line);
+    arg = line + strcspn(line, " \t");
+    if(*arg != '\0')
+        *arg++ = '\0';
+    arg = conf_trim(arg);
+    if(!strcmp(line, "list"))
+        ret = admin_list(context, b, arg);
+    else if(!strcmp(line, "lookup"))
+        ret = admin_lookup(context, b, arg);
+    else if(!strcmp(line, "release"))
+        ret = admin_release(context, b, arg);
+    else if(!strcmp(line, "stats"))
+        ret = admin_stats(context, b);
+    else if(*line != '\0')
+        stats_printf(b, "error unknown command %s\n", line);
+    if(ret != 0)
+        stats_printf(b, "error busy or out of memory, try again\n");
+}
+
+static void
+admin_close(admin_conn *conn){
+    close(conn->fd);
+    free(conn->out.data);
+    free(conn);
+}
+
+/*
+ * Send what is pending, return -1 when the connection is gone
+ */
+static int
+admin_flush(int epfd, admin_conn *conn){
+    struct epoll_event ev;
+
+    while(conn->sent < conn->out.len){
+        ssize_t n = send(conn->fd, conn->out.data + conn->sent, conn->out.len - conn->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(n <= 0)
+            return -1;
+        conn->sent += n;
+    }
+    // Commands are read again once the answer is out
+    ev.events = conn->sent < conn->out.len ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = conn;
+    if(conn->sent == conn->out.len)
+        conn->out.len = conn->sent = 0;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/*
+ * Read the commands of the connection, return -1 when it is gone
+ */
+static int
+admin_read(struct plugin_context *context, int epfd, admin_conn *conn){
+    ssize_t n = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, MSG_DONTWAIT);
+    char *line, *nl;
+
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if(n <= 0)
+        return -1;
+    conn->in_len += n;
+    line = conn->in;
+    while((nl = memchr(line, '\n', conn->in_len - (line - conn->in))) != NULL){
+        *nl = '\0';
+        if(nl > line && nl[-1] == '\r')
+            nl[-1] = '\0';
+        if(!strcmp(conf_trim(line), "quit"))
+            return -1;
+        admin_command(context, &conn->out, line);
+        line = nl + 1;
+    }
+    conn->in_len -= line - conn->in;
+    memmove(conn->in, line, conn->in_len);
+    if(conn->in_len == sizeof(conn->in))
+        return -1;
+    if(conn->out.failed)
+        return -1;
+    return admin_flush(epfd, conn);
+}
+
+static void *
+admin_thread(void *arg){
+    struct plugin_context *context = (struct plugin_context *) arg;
+    struct epoll_event ev, events[ADMIN_MAX_CONNS + 2];
+    admin_conn *conns[ADMIN_MAX_CONNS] = { NULL };
+    int epfd = epoll_create1(EPOLL_CLOEXEC), i, n, slot;
+
+    if(epfd < 0)
+        return NULL;
+    // data.ptr is NULL for the listening socket and the context for the stop pipe
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, context->admin_fd, &ev);
+    ev.data.ptr = context;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, context->admin_pipe[0], &ev);
+    for(;;){
+        n = epoll_wait(epfd, events, ADMIN_MAX_CONNS + 2, -1);
+        if(n < 0 && errno != EINTR)
+            break;
+        for(i = 0; i < n; i++){
+            admin_conn *conn = events[i].data.ptr;
+            if(events[i].data.ptr == context)
+                goto stop;
+            if(conn == NULL){
+                int fd = accept(context->admin_fd, NULL, NULL);
+                if(fd < 0)
+                    continue;
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                for(slot = 0; slot < ADMIN_MAX_CONNS && conns[slot] != NULL; slot++)
+                    ;
+                if(slot == ADMIN_MAX_CONNS || (conn = calloc(1, sizeof(admin_conn))) == NULL){
+                    close(fd);
+                    continue;
+                }
+                conn->fd = fd;
+                conn->slot = slot;
+                ev.events = EPOLLIN;
+                ev.data.ptr = conn;
+                if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0){
+                    admin_close(conn);
+                    continue;
+                }
+                conns[slot] = conn;
+                continue;
+            }
+            if(((events[i].events & EPOLLOUT) ? admin_flush(epfd, conn) : admin_read(context, epfd, conn)) != 0
+               || (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN))){
+                epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                conns[conn->slot] = NULL;
+                admin_close(conn);
+            }
+        }
+    }
+stop:
+    for(slot = 0; slot < ADMIN_MAX_CONNS; slot++){
+        if(conns[slot] != NULL)
+            admin_close(conns[slot]);
+    }
+    close(epfd);
+    return NULL;
+}
+
+static int
+start_admin(struct plugin_context *context){
+    if(context->admin_socket == NULL)
+        return 0;
+    context->admin_fd = stats_listen(context->admin_socket);
+    if(context->admin_fd < 0)
+        return -1;
+    // A client gone before accept must not block the thread
+    fcntl(context->admin_fd, F_SETFL, fcntl(context->admin_fd, F_GETFL) | O_NONBLOCK);
+    if(pipe(context->admin_pipe) != 0){
+        close(context->admin_fd);
+        return -1;
+    }
+    if(pthread_create(&context->admin_thread, NULL, admin_thread, context) != 0){
+        close(context->admin_pipe[0]);
+        close(context->admin_pipe[1]);
+        close(context->admin_fd);
+        return -1;
+    }
+    context->admin_running = 1;
+    return 0;
+}
+
+static void
+stop_admin(struct plugin_context *context){
+    if(!context->admin_running)
+        return;
+    wake_thread(context->admin_pipe[1]);
+    pthread_join(context->admin_thread, NULL);
+    close(context->admin_pipe[0]);
+    close(context->admin_pipe[1]);
+    close(context->admin_fd);
+    unlink(context->admin_socket);
+    context->admin_running = 0;
+}
+
+/*
+ * Plugin arguments after the configuration file: the client-config-dir,
+ * which is optional, and name=value options
+ *
+ *   async=1   defer client connect to a worker thread (openvpn 2.5+)
+ *   verb=N    log level, 0 errors, 1 warnings, 2 information (default),
+ *             3 debug
+ *   stats=FILE           write the metrics in FILE
+ *   stats-interval=N     every N seconds (default 10)
+ *   stats-socket=PATH    send the metrics to whoever connects to PATH
+ *   admin-socket=PATH    answer the admin commands on PATH
+ *   grace=N   hold the address of a client that leaves for N seconds
+ *             (default 0, up to 30 days)
+ *   tls-verify=1  refuse during the TLS handshake the clients that match
+ *             no realm or whose realm is full
+ */
+static int
+parse_plugin_args(struct plugin_context *context, const char *argv[]){
+    int i;
+    for(i = 2; argv[i] != NULL; i++){
+        const char *value = strchr(argv[i], '=');
+        if(value == NULL){
+            if(context->conf_dir != NULL){
+                realm_log(REALM_LOG_ERROR, "Unexpected argument %s", argv[i]);
+                return -1;
+            }
+            context->conf_dir = strdup(argv[i]);
+        }else if(!strncmp(argv[i], "async=", 6)){
+            context->async = atoi(value + 1);
+        }else if(!strncmp(argv[i], "verb=", 5)){
+            logger.level = atoi(value + 1);
+        }else if(!strncmp(argv[i], "stats=", 6)){
+            free(context->stats_file);
+            context->stats_file = strdup(value + 1);
+        }else if(!strncmp(argv[i], "stats-interval=", 15)){
+            context->stats_interval = atoi(value + 1);
+        }else if(!strncmp(argv[i], "tls-verify=", 11)){
+            context->tls_verify = atoi(value + 1);
+        }else if(!strncmp(argv[i], "grace=", 6)){
+            char *end;
+            long grace = strtol(value + 1, &end, 10);
+            if(end == value + 1 || *end != '\0' || grace < 0 || grace > GRACE_MAX){
+                realm_log(REALM_LOG_ERROR, "Invalid grace period %s", value + 1);
+                return -1;
+            }
+            context->grace = (int) grace;
+        }else if(!strncmp(argv[i], "shm=", 4)){
+            free(context->shm);
+            context->shm = strdup(value + 1);
+        }else if(!strncmp(argv[i], "shm-id=", 7)){
+            char *end;
+            long id = strtol(value + 1, &end, 10);
+            if(end == value + 1 || *end != '\0' || id < 1 || id > POOL_MAX_ID){
+                realm_log(REALM_LOG_ERROR, "Invalid shm-id %s, it goes from 1 to %d", value + 1, POOL_MAX_ID);
+                return -1;
+            }
+            context->shm_id = (int) id;
+        }else if(!strncmp(argv[i], "stats-socket=", 13)){
+            free(context->stats_socket);
+            context->stats_socket = strdup(value + 1);
+        }else if(!strncmp(argv[i], "admin-socket=", 13)){
+            free(context->admin_socket);
+            context->admin_socket = strdup(value + 1);
+        }else{
+            realm_log(REALM_LOG_ERROR, "Unknown option %s", argv[i]);
+            return -1;
+        }
+    }
+    // Two instances with the same id would take back each other addresses
+    if(context->shm != NULL && context->shm_id == 0){
+        realm_log(REALM_LOG_ERROR, "shm=%s needs a shm-id= unique to this instance", context->shm);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Free Context: This function will free the context for the plugin 
+ */
+static int free_plugin_context(plugin_context * context){
+    int i;
+    stop_admin(context);
+    stop_stats(context);
+    stop_connect_thread(context);
+    stop_reload(context);
+    hold_free(&context->holds);
+    free(context->clients.slots);
+    for(i = 0; i < context->numRealm ; i++){
+        free_realm(context->configs[i]);
+    }
+    free(context->configs);
+    free(context->by_network);
+    matcher_free(context->matcher);
+    lease_close(context->leases);
+    learn_free(&context->learned);
+    if(context->conf_dirfd >= 0)
+        close(context->conf_dirfd);
+    return 0;
+}
+
+/*
+ * Plugin open, for both openvpn_plugin_open_v1 and openvpn_plugin_open_v3
+ */
+static struct plugin_context *
+plugin_open (unsigned int *type_mask, const char *argv[], const char *envp[], plugin_log_t plugin_log)
+{
+    struct plugin_context *context;
+    int i;
+
+    log_init(REALM_LOG_DEFAULT_LEVEL, plugin_log);
+    /*
+     *    Allocate our context
+     */
+    context = (struct plugin_context *) calloc (1, sizeof (struct plugin_context))    ;
+    if(context == NULL){
+        realm_log(REALM_LOG_ERROR, "Could not allocate the plugin context");
+        log_flush();
+        return NULL;
+    }
+    realm_log(REALM_LOG_DEBUG, "PLUGIN_CONFIGURATION");
+    context->plugin_conf = strdup(argv[1]);
+    context->conf_dirfd = -1;
+    realm_log(REALM_LOG_INFO, "PLUGIN_CONFIGURATION_FILE: %s",argv[1]);
+    // The folder is only used without async, the worker writes the file given by openvpn
+    if(context->plugin_conf == NULL || parse_plugin_args(context, argv) != 0 || (!context->async && conf_dir_open(context) != 0)){
+        free(context->plugin_conf);
+        free(context->conf_dir);
+        free(context->stats_file);
+        free(context->stats_socket);
+        free(context->admin_socket);
+        free(context->shm);
+        free(context);
+        log_flush();
+        return NULL;
+    }
+    if(context->conf_dirfd >= 0)
+        realm_log(REALM_LOG_INFO, "PLUGIN_CONFIGURATION_DIR: %s",context->conf_dir);
+    pthread_mutex_init(&context->lock, NULL);
+    context->clients.name_offset = offsetof(struct plugin_per_client_context, common_name);
+    context->holds.index.name_offset = offsetof(lease_hold, common_name);
+
+    if(load_realms(context, argv, envp) != 0){
+        realm_log(REALM_LOG_ERROR, "Could not load the realms of %s", context->plugin_conf);
+        free_plugin_context(context);
+        free(context->plugin_conf);
+        free(context->conf_dir);
+        free(context->stats_file);
+        free(context->stats_socket);
+        free(context->admin_socket);
+        free(context->shm);
+        free(context);
+        log_flush();
+        return NULL;
+    }
+    for(i = 0; i < context->numRealm; i++){
+        share_realm(context->configs[i], 1);
+        context->pf |= context->configs[i]->pf != NULL;
+    }
+    // Reload the leases, the plugin still works without them
+    context->leases = lease_open(context);
+    // Watch plugin_conf for changes
+    if(start_reload(context) != 0)
+        realm_log(REALM_LOG_WARN, "Could not start the reload thread, %s will not be reloaded", context->plugin_conf);
+    if(context->async && start_connect_thread(context) != 0){
+        realm_log(REALM_LOG_WARN, "Could not start the connect thread, client connect will not be deferred");
+        context->async = 0;
+        if(conf_dir_open(context) != 0){
+            realm_log(REALM_LOG_WARN, "Configuration returned to openvpn instead of %s", context->conf_dir);
+            free(context->conf_dir);
+            context->conf_dir = NULL;
+        }
+    }
+    if(start_stats(context) != 0)
+        realm_log(REALM_LOG_WARN, "Could not start the metrics export");
+    if(start_admin(context) != 0)
+        realm_log(REALM_LOG_WARN, "Could not start the admin socket %s", context->admin_socket);
+    /*
+     *  The client-config-dir file must exist before openvpn reads it, so
+     *  it is written on TLS_FINAL, at the end of the first handshake.
+     *  Otherwise the configuration goes back in the return list of
+     *  CLIENT_CONNECT_V2. In async mode it is written by the worker in the
+     *  file given to CLIENT_CONNECT. IPCHANGE, which comes again when a
+     *  client floats, only updates the client metadata.
+     */
+    *type_mask = OPENVPN_PLUGIN_MASK (OPENVPN_PLUGIN_CLIENT_DISCONNECT) | OPENVPN_PLUGIN_MASK (OPENVPN_PLUGIN_LEARN_ADDRESS)
+                 | OPENVPN_PLUGIN_MASK (OPENVPN_PLUGIN_IPCHANGE);
+    if(context->async){
+        *type_mask |= OPENVPN_PLUGIN_MASK (OPENVPN_PLUGIN_CLIENT_CONNECT);
+        realm_log(REALM_LOG_INFO, "PLUGIN_CONNECT: deferred CLIENT_CONNECT, configuration written by the worker thread");
+    }else if(context->conf_dir != NULL){
+        *type_mask |= OPENVPN_PLUGIN_MASK (OPENVPN_PLUGIN_TLS_FINAL);
+        realm_log(REALM_LOG_INFO, "PLUGIN_CONNECT: TLS_FINAL, configuration written in %s", context->conf_dir);
+    }else{
+        *type_mask |= OPENVPN_PLUGIN_MASK (OPENVPN_PLUGIN_CLIENT_CONNECT_V2);
+        realm_log(REALM_LOG_INFO, "PLUGIN_CONNECT: CLIENT_CONNECT_V2, configuration returned to openvpn");
+    }
+    if(context->tls_verify)
+        *type_mask |= OPENVPN_PLUGIN_MASK (OPENVPN_PLUGIN_TLS_VERIFY);
+    // Only asked for when used, openvpn 2.6 refuses plugins that ask for it
+    if(context->pf)
+        *type_mask |= OPENVPN_PLUGIN_MASK (OPENVPN_PLUGIN_ENABLE_PF);
+
+    log_flush();
+    return context;
+}
+
+OPENVPN_EXPORT openvpn_plugin_handle_t
+openvpn_plugin_open_v1 (unsigned int *type_mask, const char *argv[], const char *envp[])
+{
+    return (openvpn_plugin_handle_t) plugin_open(type_mask, argv, envp, NULL);
+}
+
+/*
+ * With the v3 interface the messages go to the openvpn log
+ */
+OPENVPN_EXPORT int
+openvpn_plugin_open_v3 (const int version,
+                        struct openvpn_plugin_args_open_in const *args,
+                        struct openvpn_plugin_args_open_return *ret)
+{
+    struct plugin_context *context;
+    unsigned int type_mask = 0;
+
+    if(version < OPENVPN_PLUGINv3_STRUCTVER)
+        return OPENVPN_PLUGIN_FUNC_ERROR;
+    context = plugin_open(&type_mask, args->argv, args->envp,
+                          args->callbacks != NULL ? args->callbacks->plugin_log : NULL);
+    if(context == NULL)
+        return OPENVPN_PLUGIN_FUNC_ERROR;
+    ret->type_mask = type_mask;
+    *ret->handle = (openvpn_plugin_handle_t) context;
+    return OPENVPN_PLUGIN_FUNC_SUCCESS;
+}
+
+OPENVPN_EXPORT int
+openvpn_plugin_func_v2 (openvpn_plugin_handle_t handle,
+			const int type,
+			const char *argv[],
+			const char *envp[],
+			void *per_client_context,
+			struct openvpn_plugin_string_list **return_list)
+{
+    struct plugin_context *context = (struct plugin_context *) handle;
+    struct plugin_per_client_context *client_conf = (struct plugin_per_client_context *) per_client_context;
+    int ret;
+    uint64_t start = latency_now();
+    // Swap in the new configuration if the reload thread built one
+    apply_reload(context);
+    switch (type)
+        { 
+        case OPENVPN_PLUGIN_TLS_VERIFY:
+            ret = client_tls_verify (context, argv, envp);
+            break;
+        case OPENVPN_PLUGIN_TLS_FINAL:
+            realm_log(REALM_LOG_DEBUG, "OPENVPN_PLUGIN_TLS_FINAL");
+            // A renegotiation, the client already has its address and its file
+            if(client_conf->realm != NULL){
+                ret = OPENVPN_PLUGIN_FUNC_SUCCESS;
+                break;
+            }
+            ret = client_connect (context, argv, envp, client_conf, NULL);
+            latency_record(&context->latency, start);
+            break;
+        case OPENVPN_PLUGIN_IPCHANGE:
+            realm_log(REALM_LOG_DEBUG, "OPENVPN_PLUGIN_IPCHANGE");
+            ret = client_ipchange (context, envp, client_conf);
+            break;
+        case OPENVPN_PLUGIN_CLIENT_CONNECT:
+            realm_log(REALM_LOG_DEBUG, "OPENVPN_PLUGIN_CLIENT_CONNECT");
+            ret = client_connect_deferred (context, argv, envp, client_conf);
+            // Deferred connections are timed by the worker
+            if(ret != OPENVPN_PLUGIN_FUNC_DEFERRED)
+                latency_record(&context->latency, start);
+            break;
+        case OPENVPN_PLUGIN_CLIENT_CONNECT_V2:
+            realm_log(REALM_LOG_DEBUG, "OPENVPN_PLUGIN_CLIENT_CONNECT_V2");
+            ret = client_connect (context, argv, envp, client_conf, return_list);
+            latency_record(&context->latency, start);
+            break;
+        case OPENVPN_PLUGIN_CLIENT_DISCONNECT:
+            realm_log(REALM_LOG_DEBUG, "OPENVPN_PLUGIN_CLIENT_DISCONNECT");
+            ret = client_disconnect (context, argv, envp, client_conf);
+            break;
+        case OPENVPN_PLUGIN_LEARN_ADDRESS:
+            realm_log(REALM_LOG_DEBUG, "OPENVPN_PLUGIN_LEARN_ADDRESS");
+            ret = client_learn (context, argv, client_conf);
+            break;
+        case OPENVPN_PLUGIN_ENABLE_PF:
+            realm_log(REALM_LOG_DEBUG, "OPENVPN_PLUGIN_ENABLE_PF");
+            ret = client_enable_pf (context, envp, client_conf);
+            break;
+        default:
+            realm_log(REALM_LOG_WARN, "OPENVPN_PLUGIN_? %d", type);
+            ret = OPENVPN_PLUGIN_FUNC_ERROR;
+            break;
+    }
+    log_maybe_flush();
+    return ret;
+}
+
+OPENVPN_EXPORT void *
+openvpn_plugin_client_constructor_v1 (openvpn_plugin_handle_t handle)
+{
+  realm_log(REALM_LOG_DEBUG, "openvpn_plugin_client_constructor_v1");
+  return calloc (1, sizeof (struct plugin_per_client_context));
+}
+
+OPENVPN_EXPORT void
+openvpn_plugin_client_destructor_v1 (openvpn_plugin_handle_t handle, void *per_client_context)
+{
+    struct plugin_context *context = (struct plugin_context *) handle;
+    struct plugin_per_client_context *client_conf = (struct plugin_per_client_context *) per_client_context;
+    realm_log(REALM_LOG_DEBUG, "openvpn_plugin_client_destructor_v1");
+    if(client_conf != NULL){
+        // The worker may still have a connection queued for this client
+        pthread_mutex_lock(&context->lock);
+        if(client_conf->job != NULL)
+            client_conf->job->client = NULL;
+        client_release(context, client_conf);
+        learn_forget(context, client_conf);
+        pthread_mutex_unlock(&context->lock);
+        free (client_conf);
     }
 }
 
@@ -466,4 +5451,12 @@ openvpn_plugin_close_v1 (openvpn_plugin_handle_t handle)
 {
   struct plugin_context *context = (struct plugin_context *) handle;
   free_plugin_context(context);
+  free(context->conf_dir);
+  free(context->plugin_conf);
+  free(context->stats_file);
+  free(context->stats_socket);
+  free(context->admin_socket);
+  free(context->shm);
+  free(context);
+  log_flush();
 }
@@ -0,0 +1,517 @@
+/*
+ * Tests of the plugin without openvpn: like the bench, test_plugin loads
+ * simple.so and plays the calls openvpn makes for each client, then checks
+ * the answers of the plugin.
+ *
+ *   $ make check
+ *
+ * The cases:
+ *   pool       a /30 gives one address in the return list of
+ *              CLIENT_CONNECT_V2, the next client is refused
+ *   grace      a client that leaves gets its address back inside the grace
+ *              period, without grace the address goes to the next client
+ *   restart    a new plugin gives the clients their address from
+ *              plugin.conf.leases, after a crash it keeps them reserved
+ *   reload     a changed plugin.conf is loaded without losing the leases
+ *   matcher    the realm of random common names is the first one the
+ *              original regex matcher accepts
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include "openvpn-plugin.h"
+
+// The reload thread checks plugin.conf every second and waits for it to settle
+#define RELOAD_WAIT_MS 10000
+
+typedef openvpn_plugin_handle_t (*open_v1_t)(unsigned int *, const char *[], const char *[]);
+typedef int (*func_v2_t)(openvpn_plugin_handle_t, const int, const char *[], const char *[], void *, struct openvpn_plugin_string_list **);
+typedef void *(*constructor_t)(openvpn_plugin_handle_t);
+typedef void (*destructor_t)(openvpn_plugin_handle_t, void *);
+typedef void (*close_v1_t)(openvpn_plugin_handle_t);
+
+typedef struct plugin{
+    void *dl;
+    open_v1_t open;
+    func_v2_t func;
+    constructor_t constructor;
+    destructor_t destructor;
+    close_v1_t close;
+    openvpn_plugin_handle_t handle;
+}plugin;
+
+/*
+ * A connected client: its per client context and the address it was given
+ */
+typedef struct client{
+    char common_name[64];
+    void *context;
+    uint32_t address;
+}client;
+
+static char dir[] = "/tmp/realm-test-XXXXXX";
+static char conf[PATH_MAX];
+static char leases[PATH_MAX];
+static int failures;
+
+#define CHECK(cond, ...) do{ \
+    if(!(cond)){ \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+}while(0)
+
+static int
+load_plugin(plugin *p, const char *path){
+    p->dl = dlopen(path, RTLD_NOW);
+    if(p->dl == NULL){
+        fprintf(stderr, "%s\n", dlerror());
+        return -1;
+    }
+    p->open = (open_v1_t) dlsym(p->dl, "openvpn_plugin_open_v1");
+    p->func = (func_v2_t) dlsym(p->dl, "openvpn_plugin_func_v2");
+    p->constructor = (constructor_t) dlsym(p->dl, "openvpn_plugin_client_constructor_v1");
+    p->destructor = (destructor_t) dlsym(p->dl, "openvpn_plugin_client_destructor_v1");
+    p->close = (close_v1_t) dlsym(p->dl, "openvpn_plugin_close_v1");
+    if(p->open == NULL || p->func == NULL || p->constructor == NULL || p->destructor == NULL || p->close == NULL){
+        fprintf(stderr, "%s is not an openvpn v2 plugin\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+write_conf(const char *text){
+    FILE *fh = fopen(conf, "w");
+    if(fh == NULL)
+        return -1;
+    fputs(text, fh);
+    return fclose(fh);
+}
+
+/*
+ * Open the plugin on plugin.conf with the options, NULL terminated
+ */
+static int
+plugin_start(plugin *p, const char *text, ...){
+    const char *argv[8] = { "simple.so", conf, "verb=0" };
+    const char *envp[] = { NULL };
+    unsigned int type_mask = 0;
+    const char *option;
+    va_list ap;
+    int argc = 3;
+
+    if(text != NULL && write_conf(text) != 0){
+        perror(conf);
+        return -1;
+    }
+    va_start(ap, text);
+    while(argc < 7 && (option = va_arg(ap, const char *)) != NULL)
+        argv[argc++] = option;
+    va_end(ap);
+    argv[argc] = NULL;
+    p->handle = p->open(&type_mask, argv, envp);
+    if(p->handle == NULL)
+        return -1;
+    if(!(type_mask & OPENVPN_PLUGIN_MASK(OPENVPN_PLUGIN_CLIENT_CONNECT_V2))){
+        p->close(p->handle);
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t
+parse_address(const char *s){
+    unsigned int a, b, c, d;
+    if(sscanf(s, "%u.%u.%u.%u", &a, &b, &c, &d) != 4)
+        return 0;
+    return a << 24 | b << 16 | c << 8 | d;
+}
+
+/*
+ * CLIENT_CONNECT_V2 for the common name, the address of the return list
+ * is kept in the client. Return the result of the callback; a success must
+ * come with a single config entry holding the ifconfig-push.
+ */
+static int
+do_connect(plugin *p, client *c, const char *common_name){
+    const char *argv[] = { "test", NULL };
+    char env[80];
+    const char *envp[] = { env, "untrusted_ip=192.0.2.1", "untrusted_port=1194", NULL };
+    struct openvpn_plugin_string_list *list = NULL, *next;
+    int ret;
+
+    snprintf(c->common_name, sizeof(c->common_name), "%s", common_name);
+    snprintf(env, sizeof(env), "common_name=%s", common_name);
+    c->context = p->constructor(p->handle);
+    c->address = 0;
+    ret = p->func(p->handle, OPENVPN_PLUGIN_CLIENT_CONNECT_V2, argv, envp, c->context, &list);
+    if(ret == OPENVPN_PLUGIN_FUNC_SUCCESS){
+        CHECK(list != NULL && list->next == NULL, "%s: one entry expected in the return list", common_name);
+        if(list != NULL){
+            CHECK(!strcmp(list->name, "config"), "%s: return list entry %s", common_name, list->name);
+            CHECK(!strncmp(list->value, "ifconfig-push ", 14), "%s: config %s", common_name, list->value);
+            if(!strncmp(list->value, "ifconfig-push ", 14))
+                c->address = parse_address(list->value + 14);
+        }
+    }else{
+        CHECK(list == NULL, "%s: return list of a refused client", common_name);
+        p->destructor(p->handle, c->context);
+        c->context = NULL;
+    }
+    for(; list != NULL; list = next){
+        next = list->next;
+        free(list->name);
+        free(list->value);
+        free(list);
+    }
+    return ret;
+}
+
+static void
+do_disconnect(plugin *p, client *c){
+    const char *argv[] = { "test", NULL };
+    char env[80];
+    const char *envp[] = { env, NULL };
+
+    if(c->context == NULL)
+        return;
+    snprintf(env, sizeof(env), "common_name=%s", c->common_name);
+    CHECK(p->func(p->handle, OPENVPN_PLUGIN_CLIENT_DISCONNECT, argv, envp, c->context, NULL) == OPENVPN_PLUGIN_FUNC_SUCCESS,
+          "%s: disconnect failed", c->common_name);
+    p->destructor(p->handle, c->context);
+    c->context = NULL;
+}
+
+static void
+sleep_ms(int ms){
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+/*
+ * A /30 has a single address for the clients
+ */
+static void
+test_pool(plugin *p){
+    client a, b;
+
+    unlink(leases);
+    if(plugin_start(p, "10.3.0.0/30#^pool#\n", NULL) != 0){
+        CHECK(0, "pool: open failed");
+        return;
+    }
+    CHECK(do_connect(p, &a, "pool-a") == OPENVPN_PLUGIN_FUNC_SUCCESS, "pool: first client refused");
+    CHECK(a.address > 0x0a030000 && a.address < 0x0a030003, "pool: address %08x out of the /30", a.address);
+    CHECK(do_connect(p, &b, "pool-b") == OPENVPN_PLUGIN_FUNC_ERROR, "pool: second client accepted in a full realm");
+    CHECK(do_connect(p, &b, "other") == OPENVPN_PLUGIN_FUNC_ERROR, "pool: client of no realm accepted");
+    do_disconnect(p, &a);
+    p->close(p->handle);
+}
+
+/*
+ * The address of a client that leaves is held for it during the grace
+ * period, and given to the next client without grace
+ */
+static void
+test_grace(plugin *p){
+    client a, b;
+    uint32_t address;
+
+    unlink(leases);
+    if(plugin_start(p, "10.3.0.0/30#^grace#\n", "grace=60", NULL) != 0){
+        CHECK(0, "grace: open failed");
+        return;
+    }
+    CHECK(do_connect(p, &a, "grace-a") == OPENVPN_PLUGIN_FUNC_SUCCESS, "grace: first client refused");
+    address = a.address;
+    do_disconnect(p, &a);
+    CHECK(do_connect(p, &b, "grace-b") == OPENVPN_PLUGIN_FUNC_ERROR, "grace: held address given to another client");
+    CHECK(do_connect(p, &a, "grace-a") == OPENVPN_PLUGIN_FUNC_SUCCESS, "grace: client refused inside its grace period");
+    CHECK(a.address == address, "grace: %08x given back instead of %08x", a.address, address);
+    do_disconnect(p, &a);
+    p->close(p->handle);
+
+    unlink(leases);
+    if(plugin_start(p, "10.3.0.0/30#^grace#\n", NULL) != 0){
+        CHECK(0, "grace: open failed");
+        return;
+    }
+    CHECK(do_connect(p, &a, "grace-a") == OPENVPN_PLUGIN_FUNC_SUCCESS, "grace: first client refused");
+    address = a.address;
+    do_disconnect(p, &a);
+    CHECK(do_connect(p, &b, "grace-b") == OPENVPN_PLUGIN_FUNC_SUCCESS, "grace: released address not given again");
+    CHECK(b.address == address, "grace: %08x given instead of %08x", b.address, address);
+    do_disconnect(p, &b);
+    p->close(p->handle);
+}
+
+/*
+ * The leases outlive the plugin: a restarted plugin gives each client its
+ * previous address, whatever the order they come back in
+ */
+static void
+test_restart(plugin *p){
+    static const char *const names[] = { "restart-a", "restart-b", "restart-c" };
+    client c[3], other;
+    uint32_t address[3];
+    int i, status, failed;
+    pid_t pid;
+
+    unlink(leases);
+    if(plugin_start(p, "10.4.0.0/24#^restart#\n", NULL) != 0){
+        CHECK(0, "restart: open failed");
+        return;
+    }
+    for(i = 0; i < 3; i++){
+        CHECK(do_connect(p, &c[i], names[i]) == OPENVPN_PLUGIN_FUNC_SUCCESS, "restart: %s refused", names[i]);
+        address[i] = c[i].address;
+    }
+    for(i = 0; i < 3; i++)
+        do_disconnect(p, &c[i]);
+    p->close(p->handle);
+    CHECK(access(leases, F_OK) == 0, "restart: no %s", leases);
+
+    if(plugin_start(p, NULL, NULL) != 0){
+        CHECK(0, "restart: open failed");
+        return;
+    }
+    for(i = 2; i >= 0; i--){
+        CHECK(do_connect(p, &c[i], names[i]) == OPENVPN_PLUGIN_FUNC_SUCCESS, "restart: %s refused", names[i]);
+        CHECK(c[i].address == address[i], "restart: %s got %08x instead of %08x", names[i], c[i].address, address[i]);
+    }
+    for(i = 0; i < 3; i++)
+        do_disconnect(p, &c[i]);
+    p->close(p->handle);
+
+    // openvpn dies with the clients connected: their leases stay active
+    fflush(stdout);
+    failed = failures;
+    pid = fork();
+    if(pid == 0){
+        if(plugin_start(p, NULL, NULL) != 0)
+            _exit(1);
+        for(i = 0; i < 3; i++){
+            if(do_connect(p, &c[i], names[i]) != OPENVPN_PLUGIN_FUNC_SUCCESS || c[i].address != address[i])
+                _exit(1);
+        }
+        fflush(stdout);
+        _exit(failures != failed);
+    }
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+          "restart: the clients did not get their address before the crash");
+    if(plugin_start(p, NULL, NULL) != 0){
+        CHECK(0, "restart: open failed");
+        return;
+    }
+    // The addresses are reserved for their clients, a newcomer gets another one
+    CHECK(do_connect(p, &other, "restart-new") == OPENVPN_PLUGIN_FUNC_SUCCESS, "restart: newcomer refused");
+    for(i = 0; i < 3; i++)
+        CHECK(other.address != address[i], "restart: newcomer got the address of %s", names[i]);
+    for(i = 2; i >= 0; i--){
+        CHECK(do_connect(p, &c[i], names[i]) == OPENVPN_PLUGIN_FUNC_SUCCESS, "restart: %s refused", names[i]);
+        CHECK(c[i].address == address[i], "restart: %s got %08x instead of %08x", names[i], c[i].address, address[i]);
+    }
+    for(i = 0; i < 3; i++)
+        do_disconnect(p, &c[i]);
+    do_disconnect(p, &other);
+    p->close(p->handle);
+
+    // Without the lease file the first client back gets the first address
+    unlink(leases);
+    if(plugin_start(p, NULL, NULL) != 0){
+        CHECK(0, "restart: open failed");
+        return;
+    }
+    CHECK(do_connect(p, &c[2], names[2]) == OPENVPN_PLUGIN_FUNC_SUCCESS, "restart: %s refused", names[2]);
+    CHECK(c[2].address == address[0], "restart: %s got %08x without leases", names[2], c[2].address);
+    do_disconnect(p, &c[2]);
+    p->close(p->handle);
+}
+
+/*
+ * A new plugin.conf is loaded by the reload thread and swapped in at the
+ * next callback: the realm kept keeps its clients and its pool
+ */
+static void
+test_reload(plugin *p){
+    client a, b, c, d;
+    uint32_t address;
+    int waited;
+
+    unlink(leases);
+    if(plugin_start(p, "10.5.0.0/24#^reload#\n", NULL) != 0){
+        CHECK(0, "reload: open failed");
+        return;
+    }
+    CHECK(do_connect(p, &a, "reload-a") == OPENVPN_PLUGIN_FUNC_SUCCESS, "reload: first client refused");
+    address = a.address;
+    CHECK(do_connect(p, &b, "new-b") == OPENVPN_PLUGIN_FUNC_ERROR, "reload: client of no realm accepted");
+    // A realm added, the one of reload-a unchanged but for its push line
+    if(write_conf("10.5.0.0/24#^reload#\npush \"route 10.99.0.0 255.255.0.0\"\n10.6.0.0/24#^new#\n") != 0){
+        CHECK(0, "reload: could not write %s", conf);
+        p->close(p->handle);
+        return;
+    }
+    for(waited = 0; waited < RELOAD_WAIT_MS; waited += 100){
+        if(do_connect(p, &b, "new-b") == OPENVPN_PLUGIN_FUNC_SUCCESS)
+            break;
+        sleep_ms(100);
+    }
+    CHECK(b.context != NULL, "reload: the new realm was not loaded");
+    CHECK((b.address & 0xffffff00) == 0x0a060000, "reload: new-b got %08x", b.address);
+    // The address of reload-a is still taken, then given back
+    CHECK(do_connect(p, &c, "reload-c") == OPENVPN_PLUGIN_FUNC_SUCCESS, "reload: client of the kept realm refused");
+    CHECK(c.address != address, "reload: the address of a connected client was given again");
+    do_disconnect(p, &a);
+    CHECK(do_connect(p, &d, "reload-d") == OPENVPN_PLUGIN_FUNC_SUCCESS, "reload: client of the kept realm refused");
+    CHECK(d.address == address, "reload: %08x given instead of the released %08x", d.address, address);
+    do_disconnect(p, &b);
+    do_disconnect(p, &c);
+    do_disconnect(p, &d);
+    p->close(p->handle);
+}
+
+/*
+ * The regex matcher of the first version of the plugin, the reference
+ */
+static int matchstar(int c, const char *regexp, const char *text);
+
+static int
+matchhere(const char *regexp, const char *text){
+    if(regexp[0] == '\0')
+        return 1;
+    if(regexp[1] == '*')
+        return matchstar(regexp[0], regexp + 2, text);
+    if(regexp[0] == '$' && regexp[1] == '\0')
+        return *text == '\0';
+    if(*text != '\0' && (regexp[0] == '.' || regexp[0] == *text))
+        return matchhere(regexp + 1, text + 1);
+    return 0;
+}
+
+static int
+match(const char *regexp, const char *text){
+    if(regexp[0] == '^')
+        return matchhere(regexp + 1, text);
+    do{
+        if(matchhere(regexp, text))
+            return 1;
+    }while(*text++ != '\0');
+    return 0;
+}
+
+static int
+matchstar(int c, const char *regexp, const char *text){
+    do{
+        if(matchhere(regexp, text))
+            return 1;
+    }while(*text != '\0' && (*text++ == c || c == '.'));
+    return 0;
+}
+
+/*
+ * A random regex the plugin accepts: an optional ^, then characters, some
+ * of them starred, and an optional $
+ */
+static void
+random_regex(char *regex){
+    static const char chars[] = "ab.$";
+    int n = 1 + rand() % 4, i;
+    char *p = regex;
+
+    if(rand() % 2)
+        *p++ = '^';
+    for(i = 0; i < n; i++){
+        *p++ = chars[rand() % (sizeof(chars) - 1)];
+        if(rand() % 3 == 0)
+            *p++ = '*';
+    }
+    if(rand() % 3 == 0)
+        *p++ = '$';
+    *p = '\0';
+}
+
+static void
+test_matcher(plugin *p){
+    char regex[8][16], text[1024], name[16];
+    int trial, i, j, k, len;
+    client c;
+
+    for(trial = 0; trial < 20; trial++){
+        len = 0;
+        for(i = 0; i < 8; i++){
+            random_regex(regex[i]);
+            len += snprintf(text + len, sizeof(text) - len, "10.7.%d.0/24#%s#\n", i, regex[i]);
+        }
+        unlink(leases);
+        if(plugin_start(p, text, NULL) != 0){
+            CHECK(0, "matcher: open failed on\n%s", text);
+            continue;
+        }
+        for(j = 0; j < 200; j++){
+            int expected = -1, got = -1, n = 1 + rand() % 6;
+            for(k = 0; k < n; k++)
+                name[k] = "abc$"[rand() % 4];
+            name[n] = '\0';
+            for(i = 0; i < 8 && expected < 0; i++){
+                if(match(regex[i], name))
+                    expected = i;
+            }
+            if(do_connect(p, &c, name) == OPENVPN_PLUGIN_FUNC_SUCCESS){
+                got = (c.address >> 8) & 0xff;
+                do_disconnect(p, &c);
+            }
+            CHECK(got == expected, "matcher: %s in realm %d instead of %d, realms\n%s", name, got, expected, text);
+        }
+        p->close(p->handle);
+    }
+}
+
+int
+main(int argc, char *argv[]){
+    plugin p;
+
+    if(argc != 2){
+        fprintf(stderr, "usage: %s simple.so\n", argv[0]);
+        return 2;
+    }
+    srand(1);
+    memset(&p, 0, sizeof(p));
+    if(load_plugin(&p, argv[1]) != 0)
+        return 1;
+    if(mkdtemp(dir) == NULL){
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(conf, sizeof(conf), "%s/plugin.conf", dir);
+    snprintf(leases, sizeof(leases), "%s/plugin.conf.leases", dir);
+
+    test_pool(&p);
+    test_grace(&p);
+    test_restart(&p);
+    test_reload(&p);
+    test_matcher(&p);
+
+    unlink(leases);
+    unlink(conf);
+    rmdir(dir);
+    dlclose(p.dl);
+    if(failures){
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}